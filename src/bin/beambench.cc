@@ -0,0 +1,134 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// beambench.cc
+//
+//  A program that compares the speed of the two beam trimming
+//   implementations (SetBeamTrim and BeamTrim) on an FST at several beam
+//   widths, and checks that their output is identical, including when
+//   several trims are run at once in parallel threads
+
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+#include <fst/fst.h>
+#include <fst/vector-fst.h>
+#include <fst/equal.h>
+
+#include <kyfd/beam-trim.h>
+#include <kyfd/decode-stats.h>
+#include <kyfd/threads.h>
+
+using namespace std;
+using namespace fst;
+using namespace kyfd;
+
+// the number of trims to run at once when checking thread safety
+static const int kNumThreads = 4;
+
+// a single trim to be run in a thread
+struct TrimTask {
+    const StdFst * model;
+    unsigned width;
+    bool flat;
+    StdVectorFst result;
+};
+
+void* RunTrimTask(void* ptr) {
+    TrimTask * task = (TrimTask*)ptr;
+    if(task->flat)
+        BeamTrim<StdArc>(*task->model, &task->result, task->width);
+    else
+        SetBeamTrim<StdArc>(*task->model, &task->result, task->width);
+    return 0;
+}
+
+int main(int argc, const char* argv[]) {
+
+    if(argc < 2) {
+        cerr << "Usage: " << argv[0] << " model.fst [beam_width ...]" << endl
+             << " (default beam widths: 10 100 1000 10000)" << endl;
+        return 1;
+    }
+
+    // expand the model fully so that only the trimming is timed
+    StdFst * readModel = StdFst::Read(argv[1]);
+    if(readModel == 0) {
+        cerr << "Error reading in model file from " << argv[1] << endl;
+        return 1;
+    }
+    StdVectorFst model(*readModel);
+    delete readModel;
+
+    vector<unsigned> widths;
+    for(int i = 2; i < argc; i++)
+        widths.push_back(atoi(argv[i]));
+    if(widths.size() == 0) {
+        widths.push_back(10);
+        widths.push_back(100);
+        widths.push_back(1000);
+        widths.push_back(10000);
+    }
+
+    cout << "width\tset_sec\tflat_sec\tspeedup\tstates\tarcs\tidentical" << endl;
+    int ret = 0;
+    for(unsigned i = 0; i < widths.size(); i++) {
+        StageTimer timer;
+        double setWall, flatWall, cpu;
+        StdVectorFst setFst, flatFst;
+        timer.reset();
+        SetBeamTrim<StdArc>(model, &setFst, widths[i]);
+        timer.lap(setWall, cpu);
+        BeamTrim<StdArc>(model, &flatFst, widths[i]);
+        timer.lap(flatWall, cpu);
+        size_t arcs = 0;
+        for(StateIterator<StdVectorFst> siter(flatFst); !siter.Done(); siter.Next())
+            arcs += flatFst.NumArcs(siter.Value());
+        bool identical = Equal(setFst, flatFst);
+        if(!identical)
+            ret = 1;
+        cout << widths[i] << "\t" << setWall << "\t" << flatWall << "\t"
+             << (flatWall > 0 ? setWall / flatWall : 0) << "\t"
+             << flatFst.NumStates() << "\t" << arcs << "\t"
+             << (identical ? "yes" : "NO") << endl;
+    }
+
+    // run both implementations in parallel at the smallest width, and check
+    //  that every result is the same as a serial run
+    StdVectorFst serialFst;
+    BeamTrim<StdArc>(model, &serialFst, widths[0]);
+    vector<TrimTask> tasks(kNumThreads);
+    vector<pthread_t> threads(kNumThreads);
+    for(int i = 0; i < kNumThreads; i++) {
+        tasks[i].model = &model;
+        tasks[i].width = widths[0];
+        tasks[i].flat = (i % 2 == 0);
+        if(pthread_create(&threads[i], NULL, RunTrimTask, &tasks[i]))
+            throw runtime_error("Could not create a beam trim thread");
+    }
+    bool parallel = true;
+    for(int i = 0; i < kNumThreads; i++) {
+        pthread_join(threads[i], NULL);
+        parallel = parallel && Equal(serialFst, tasks[i].result);
+    }
+    if(!parallel)
+        ret = 1;
+    cout << "parallel (" << kNumThreads << " threads, width " << widths[0] << "): "
+         << (parallel ? "identical" : "DIFFERENT") << endl;
+
+    return ret;
+
+}
@@ -0,0 +1,53 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// fallbackconvert.cc
+//
+//  A program that converts a fallback map from the text format into the
+//   binary format, which can be given to the decoder in the same way but is
+//   loaded without any parsing
+
+#include <iostream>
+
+#include <fst/fst.h>
+
+#include <kyfd/fallback-matcher.h>
+
+using namespace std;
+using namespace fst;
+
+int main(int argc, const char* argv[]) {
+
+    if(argc != 3) {
+        cerr << "Usage: " << argv[0] << " fallback.txt fallback.map" << endl;
+        return 1;
+    }
+
+    try {
+        FallbackTable<StdArc::Label> * table = FallbackTable<StdArc::Label>::Read(argv[1]);
+        bool written = table->Write(argv[2]);
+        delete table;
+        if(!written) {
+            cerr << "Error writing the fallback map to " << argv[2] << endl;
+            return 1;
+        }
+    } catch(std::exception & e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+
+}
@@ -0,0 +1,210 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// fallbackexpand.cc
+//
+//  A program that adds explicit arcs to a model for the most frequent
+//   labels, in every state where they would otherwise only be found by
+//   following fallback transitions. The arcs are the ones that the
+//   FallbackMatcher would return, so the output decodes exactly like the
+//   input with the same fallback map, but follows fewer fallbacks. Labels
+//   that are themselves fallbacks of other labels are never expanded, as
+//   their new arcs would be followed as fallback transitions and change
+//   the labels that fall back to them. A report of the arcs added and the
+//   fallbacks saved for several numbers of labels is printed to help
+//   choose how many to expand.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+#include <fst/fst.h>
+#include <fst/vector-fst.h>
+#include <fst/arcsort.h>
+#include <fst/matcher.h>
+
+#include <kyfd/fallback-matcher.h>
+
+using namespace std;
+using namespace fst;
+
+typedef FallbackMatcher< Matcher<StdFst> > FB;
+
+// what expanding a single label adds and saves over all states
+struct LabelExpansion {
+    LabelExpansion() : arcs(0), fallbacks(0) { }
+    uint64 arcs;        // arcs added
+    uint64 fallbacks;   // fallback transitions no longer followed
+};
+
+// read a file with two numbers on each line, skipping blank lines
+template <class V>
+void ReadPairs(const char* fileName, map<int, V> & pairs) {
+    ifstream in(fileName);
+    if(!in)
+        throw runtime_error(string("Could not open '")+fileName+"'");
+    string line;
+    for(int lineNum = 1; getline(in, line); lineNum++) {
+        if(line.find_first_not_of(" \t\r") == string::npos)
+            continue;
+        istringstream iss(line);
+        int key;
+        V val;
+        string rest;
+        if(!(iss >> key >> val) || iss >> rest) {
+            ostringstream buff;
+            buff << "Bad line " << lineNum << " in '" << fileName << "': " << line;
+            throw runtime_error(buff.str());
+        }
+        pairs[key] = val;
+    }
+}
+
+int main(int argc, const char* argv[]) {
+
+    if(argc < 6) {
+        cerr << "Usage: " << argv[0] << " model.fst fallback.map counts.txt out.fst num_labels [report_labels ...]" << endl
+             << " counts.txt holds a label and its count on each line, for example from" << endl
+             << " the training data, and the num_labels most frequent labels are expanded," << endl
+             << " leaving out labels that other labels fall back to." << endl
+             << " (default report_labels: 10 100 1000 10000 and num_labels)" << endl;
+        return 1;
+    }
+
+    try {
+
+        StdFst * readModel = StdFst::Read(argv[1]);
+        if(readModel == 0) {
+            cerr << "Error reading in model file from " << argv[1] << endl;
+            return 1;
+        }
+        StdVectorFst model(*readModel);
+        delete readModel;
+        ArcSort(&model, ILabelCompare<StdArc>());
+
+        FallbackTable<int> * fallbacks = FallbackTable<int>::Read(argv[2]);
+        map<int, double> countMap;
+        ReadPairs(argv[3], countMap);
+
+        unsigned numLabels = atoi(argv[5]);
+        vector<unsigned> reportLabels;
+        for(int i = 6; i < argc; i++)
+            reportLabels.push_back(atoi(argv[i]));
+        if(reportLabels.size() == 0) {
+            unsigned defaults[] = { 10, 100, 1000, 10000 };
+            reportLabels.assign(defaults, defaults + 4);
+        }
+        reportLabels.push_back(numLabels);
+        sort(reportLabels.begin(), reportLabels.end());
+        reportLabels.erase(unique(reportLabels.begin(), reportLabels.end()), reportLabels.end());
+
+        // find the labels that other labels fall back to
+        set<int> targets;
+        for(size_t label = 0; label < fallbacks->NumLabels(); label++)
+            targets.insert(fallbacks->Begin(label), fallbacks->End(label));
+
+        // order the labels that can be expanded with the most frequent first
+        vector< pair<double, int> > order;
+        double totalCount = 0;
+        unsigned skipped = 0;
+        for(map<int, double>::const_iterator it = countMap.begin(); it != countMap.end(); it++) {
+            if(it->first > 0) {
+                totalCount += it->second;
+                if(targets.count(it->first))
+                    skipped++;
+                else
+                    order.push_back(make_pair(it->second, -it->first));
+            }
+        }
+        if(skipped)
+            cerr << "Not expanding " << skipped << " labels that are fallbacks of other labels" << endl;
+        sort(order.begin(), order.end(), greater< pair<double, int> >());
+        unsigned maxLabels = min((size_t)max(numLabels, reportLabels.back()), order.size());
+
+        // find what expanding each label would do in every state, adding the
+        //  arcs of the labels that are expanded to the output
+        StdVectorFst out(model);
+        Matcher<StdFst> direct(model, MATCH_INPUT);
+        FB matcher(model, MATCH_INPUT, fallbacks);
+        FallbackMatcherCounts counts;
+        matcher.SetCounts(&counts);
+        vector<LabelExpansion> expansions(maxLabels);
+        uint64 modelArcs = 0;
+        for(StateIterator<StdVectorFst> siter(model); !siter.Done(); siter.Next()) {
+            StdArc::StateId s = siter.Value();
+            modelArcs += model.NumArcs(s);
+            direct.SetState(s);
+            matcher.SetState(s);
+            for(unsigned i = 0; i < maxLabels; i++) {
+                int label = -order[i].second;
+                if(direct.Find(label))
+                    continue;
+                uint64 before = counts.fallbacks;
+                if(!matcher.Find(label))
+                    continue;
+                expansions[i].fallbacks += counts.fallbacks - before;
+                for( ; !matcher.Done(); matcher.Next()) {
+                    expansions[i].arcs++;
+                    if(i < numLabels)
+                        out.AddArc(s, matcher.Value());
+                }
+            }
+        }
+        ArcSort(&out, ILabelCompare<StdArc>());
+        if(!out.Write(argv[4])) {
+            cerr << "Error writing the model to " << argv[4] << endl;
+            return 1;
+        }
+
+        // report the trade-off at each number of labels. The weighted count
+        //  of fallbacks saved is the number saved for each label times its
+        //  count, which is how often they are saved if the states are used
+        //  equally
+        cout << "labels\tadded_arcs\tarcs\tsize_ratio\tcount_share\tfallbacks_saved\tweighted_saved" << endl;
+        uint64 arcs = 0, saved = 0;
+        double count = 0, weighted = 0;
+        unsigned next = 0;
+        for(unsigned i = 0; i <= maxLabels && next < reportLabels.size(); i++) {
+            while(next < reportLabels.size() && (reportLabels[next] == i || i == maxLabels)) {
+                cout << reportLabels[next] << "\t" << arcs << "\t" << modelArcs + arcs << "\t"
+                     << (modelArcs ? (double)(modelArcs + arcs) / modelArcs : 0) << "\t"
+                     << (totalCount ? count / totalCount : 0) << "\t"
+                     << saved << "\t" << weighted << endl;
+                next++;
+            }
+            if(i < maxLabels) {
+                arcs += expansions[i].arcs;
+                saved += expansions[i].fallbacks;
+                count += order[i].first;
+                weighted += expansions[i].fallbacks * order[i].first;
+            }
+        }
+        delete fallbacks;
+
+    } catch(std::exception & e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+
+}
@@ -20,12 +20,40 @@
 //   input
 
 #include <iostream>
+#include <fstream>
+#include <csignal>
 #include <kyfd/decoder.h>
 #include <kyfd/decoder-config.h>
+#include <kyfd/parallel-decoder.h>
+#include <kyfd/pipeline-decoder.h>
+#include <kyfd/decode-server.h>
 
 using namespace std;
 using namespace kyfd;
 
+// write the timing statistics to the file specified by "stats"
+void WriteStats(const Decoder & decoder) {
+    const string & path = decoder.getConfig().getStats();
+    ofstream out(path.c_str());
+    if(!out) {
+        cerr << "Could not open statistics file " << path << endl;
+        return;
+    }
+    decoder.writeStats(out);
+}
+
+// write the statistics every time SIGUSR1 is received
+void* WaitForStats(void* ptr) {
+    const Decoder * decoder = (const Decoder*)ptr;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    int sig;
+    while(sigwait(&signals, &sig) == 0)
+        WriteStats(*decoder);
+    return NULL;
+}
+
 int main(int argc, char** argv) {
 
     if(argc == 1) {
@@ -51,24 +79,48 @@ int main(int argc, char** argv) {
 
     time(&after);
     cerr << " Done initializing, took " << difftime(after, before) << " seconds" << endl << "Decoding..." << endl;
+
+    // block SIGUSR1 before starting any other threads so that it is only
+    //  received by the thread that writes the statistics
+    if(config->getStats().length() > 0) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+        pthread_detach(StartThread(WaitForStats, decoder));
+    }
     
     // decode
-    string line;
-    int i = 0;
-    int reload = config->getReload();
-    while(decoder->decode(cin, cout)) {
-        if(++i % 100 == 0)
-            cerr << i;
-        else
-            cerr << ".";
-        // reload the model if necessary
-        if(reload && i % reload == 0)
-            decoder->buildModels();
+    if(config->getServe().length() > 0) {
+        DecodeServer server(*decoder, config->getServe());
+        cerr << "Serving on " << config->getServe() << endl;
+        server.serve();
+    } else if(config->isPipeline()) {
+        PipelineDecoder pipeline(*decoder, config->getThreads(), config->getQueueSize());
+        pipeline.decode(cin, cout);
+    } else if(config->getThreads() > 1) {
+        ParallelDecoder parallel(*decoder, config->getThreads(), config->getQueueSize());
+        parallel.decode(cin, cout);
+    } else {
+        int i = 0;
+        int reload = config->getReload();
+        while(decoder->decode(cin, cout)) {
+            if(++i % 100 == 0)
+                cerr << i;
+            else
+                cerr << ".";
+            // reload the model if necessary
+            if(reload && i % reload == 0)
+                decoder->buildModels();
+        }
     }
 
     time(&before);
     cerr << " Done decoding, took " << difftime(before, after) << " seconds" << endl;
-    // decoder->printTimes();
+    if(config->getStats().length() > 0) {
+        decoder->printTimes(cerr);
+        WriteStats(*decoder);
+    }
 
     delete decoder;
     delete config;
@@ -0,0 +1,98 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// kyfdclient.cc
+//
+//  A client for a decoder started with "kyfd -serve". Standard input is sent
+//   to the server and the results are printed to standard output, just as
+//   if the decoder had been run directly.
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <kyfd/fd-stream.h>
+#include <kyfd/threads.h>
+
+using namespace std;
+using namespace kyfd;
+
+// send all of standard input to the server, then close the sending side
+void* SendInput(void* ptr) {
+    int fd = *(int*)ptr;
+    {
+        FdStreamBuf buf(fd);
+        ostream out(&buf);
+        char data[4096];
+        while(cin.read(data, sizeof(data)) || cin.gcount() > 0)
+            out.write(data, cin.gcount());
+        out.flush();
+    }
+    shutdown(fd, SHUT_WR);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+
+    if(argc != 2) {
+        cerr << "Usage: " << argv[0] << " socket" << endl;
+        return 1;
+    }
+
+    // connect to the server
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        cerr << "Socket path " << argv[1] << " is too long" << endl;
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        cerr << "Could not connect to a server at " << argv[1] << endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // send the input in a separate thread so the results can be read as
+    //  they come back
+    pthread_t sender = StartThread(SendInput, &fd);
+
+    // read the results
+    FdStreamBuf buf(fd);
+    istream in(&buf);
+    string line;
+    int ret = 0;
+    while(getline(in, line)) {
+        if(line.compare(0, 6, "ERROR ") == 0) {
+            cerr << line.substr(6) << endl;
+            ret = 1;
+            continue;
+        }
+        int lines = atoi(line.c_str());
+        for(int i = 0; i < lines && getline(in, line); i++)
+            cout << line << endl;
+    }
+
+    pthread_join(sender, NULL);
+    close(fd);
+    return ret;
+
+}
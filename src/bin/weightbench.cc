@@ -0,0 +1,117 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// weightbench.cc
+//
+//  A program that compares the speed of the scalar and vector versions of
+//   the component weight kernels at several widths, and checks that their
+//   results are identical
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <kyfd/component-weight.h>
+#include <kyfd/decode-stats.h>
+
+using namespace std;
+using namespace fst;
+using namespace kyfd;
+
+// the number of weights in each array, small enough to stay in the cache
+static const int kNumWeights = 1024;
+
+typedef enum { ADD_OP, SUBTRACT_OP, NEGATE_OP, QUANTIZE_OP, NUM_OPS } KernelOp;
+
+const char* kOpNames[] = { "times", "divide", "oneover", "quantize" };
+
+// run a kernel over all the weights in an array
+void RunKernel(KernelOp op, bool useVector, unsigned short width,
+               const float* c1, const float* c2, float* c3) {
+    for(int i = 0; i < kNumWeights; i++, c1 += width, c2 += width, c3 += width) {
+        switch(op) {
+            case ADD_OP:
+                if(useVector) AddComponentsVector(width, c1, c2, c3);
+                else AddComponentsScalar(width, c1, c2, c3);
+                break;
+            case SUBTRACT_OP:
+                if(useVector) SubtractComponentsVector(width, c1, c2, c3);
+                else SubtractComponentsScalar(width, c1, c2, c3);
+                break;
+            case NEGATE_OP:
+                if(useVector) NegateComponentsVector(width, c1, c3);
+                else NegateComponentsScalar(width, c1, c3);
+                break;
+            default:
+                if(useVector) QuantizeComponentsVector(width, c1, c3, kDelta);
+                else QuantizeComponentsScalar(width, c1, c3, kDelta);
+        }
+    }
+}
+
+// time a kernel over the whole array, repeated reps times
+double TimeKernel(KernelOp op, bool useVector, unsigned short width, int reps,
+                  const float* c1, const float* c2, float* c3) {
+    StageTimer timer;
+    double wall, cpu;
+    timer.reset();
+    for(int i = 0; i < reps; i++)
+        RunKernel(op, useVector, width, c1, c2, c3);
+    timer.lap(wall, cpu);
+    return wall;
+}
+
+int main(int argc, const char* argv[]) {
+
+    vector<unsigned short> widths;
+    for(int i = 1; i < argc; i++)
+        widths.push_back(atoi(argv[i]));
+    if(widths.size() == 0) {
+        unsigned short defaults[] = { 2, 4, 8, 12, 16, 32 };
+        widths.assign(defaults, defaults + 6);
+    }
+
+    cout << "op\twidth\tscalar_sec\tvector_sec\tspeedup\tidentical" << endl;
+    int ret = 0;
+    for(unsigned w = 0; w < widths.size(); w++) {
+        unsigned short width = widths[w];
+        if(width == 0) {
+            cerr << "Widths must be at least 1" << endl;
+            return 1;
+        }
+        vector<float> c1(kNumWeights*width), c2(kNumWeights*width);
+        vector<float> scalar(kNumWeights*width), vec(kNumWeights*width);
+        for(unsigned i = 0; i < c1.size(); i++) {
+            c1[i] = (rand() % 100000) / 1000.0F;
+            c2[i] = (rand() % 100000) / 1000.0F;
+        }
+        // do about the same number of operations at each width
+        int reps = 20000000 / (kNumWeights * width) + 1;
+        for(int op = 0; op < NUM_OPS; op++) {
+            double scalarWall = TimeKernel((KernelOp)op, false, width, reps, &c1[0], &c2[0], &scalar[0]);
+            double vectorWall = TimeKernel((KernelOp)op, true, width, reps, &c1[0], &c2[0], &vec[0]);
+            bool identical = !memcmp(&scalar[0], &vec[0], scalar.size()*sizeof(float));
+            if(!identical)
+                ret = 1;
+            cout << kOpNames[op] << "\t" << width << "\t" << scalarWall << "\t" << vectorWall << "\t"
+                 << (vectorWall > 0 ? scalarWall / vectorWall : 0) << "\t"
+                 << (identical ? "yes" : "NO") << endl;
+        }
+    }
+
+    return ret;
+
+}
@@ -26,6 +26,8 @@
 #include <fst/weight.h>
 #include <set>
 #include <list>
+#include <vector>
+#include <algorithm>
 
 // #define BEAM_DEBUG
 
@@ -33,7 +35,8 @@ namespace fst {
 
 template <class Arc> class HypothesisLess;
 
-// a class that holds a single hypothesis
+// a class that holds a single hypothesis. Hypotheses are numbered by the
+//  search that makes them, in the order they are made, to break ties
 template <class Arc>
 class Hypothesis {
 
@@ -45,11 +48,11 @@ public:
     typedef typename Arc::Weight Weight;
 
     // ctor
-    Hypothesis() : number_(globalId_++), state_(kNoStateId) { };
+    Hypothesis() : state_(kNoStateId), number_(0) { };
 
     // ctor
-    Hypothesis(Arc arc, Weight weight, StateId state, bool best = true)
-             : arc_(arc), weight_(weight), state_(state), number_(globalId_++), best_(best) { }
+    Hypothesis(Arc arc, Weight weight, StateId state, unsigned number, bool best = true)
+             : arc_(arc), weight_(weight), state_(state), number_(number), best_(best) { }
 
     // dtor
     ~Hypothesis() { }
@@ -64,7 +67,6 @@ public:
     
     // setters
     void setState(StateId stateId) { arc_.nextstate = stateId; }
-    static void setGlobalId(unsigned globalId) { globalId_ = globalId; }
     void setBest(bool best) { best_ = best; }
 
 private:
@@ -73,13 +75,9 @@ private:
     StateId state_;
     unsigned number_;
     bool best_;
-    
-    static unsigned globalId_;
 
 };
 
-template <class Arc> unsigned Hypothesis<Arc>::globalId_;
-
 template <class Arc>
 std::ostream& operator << (std::ostream& os, const Hypothesis<Arc> & hyp) {
     os << hyp.getState() << "--" 
@@ -89,6 +87,7 @@ std::ostream& operator << (std::ostream& os, const Hypothesis<Arc> & hyp) {
        << hyp.getNextState() << "=="
        << hyp.getWeight() << " ["
        << hyp.getNumber() << "]";
+    return os;
 }
 
 // a less-than function for hypotheses
@@ -102,7 +101,7 @@ public:
     
     HypothesisLess() { };
 
-    bool operator()(const Hypothesis<Arc> & o1, const Hypothesis<Arc> & o2) {
+    bool operator()(const Hypothesis<Arc> & o1, const Hypothesis<Arc> & o2) const {
         if(weightLess(o1.weight_, o2.weight_))
             return true;
         else if(weightLess(o2.weight_, o1.weight_))
@@ -116,9 +115,22 @@ private:
 
 };
 
-// do a beam-search type trim, aligning the number of non-epsilon input symbols
+// counts of the work done by a single beam trim
+struct BeamTrimCounts {
+    BeamTrimCounts() : steps(0), inserted(0), pruned(0), recombined(0) { }
+    uint64 steps;       // input symbols stepped through
+    uint64 inserted;    // hypotheses added to the beam
+    uint64 pruned;      // hypotheses that fell outside of the beam
+    uint64 recombined;  // hypotheses merged into a better one in the same state
+};
+
+// do a beam-search type trim, aligning the number of non-epsilon input symbols.
+//  This is the original implementation using sets and maps, which is kept
+//  as a reference for BeamTrim (below), which gives identical output. All
+//  state is local to the call, so trims can be run in parallel threads
 template <class Arc>
-void BeamTrim(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth) {
+void SetBeamTrim(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth,
+                 BeamTrimCounts * counts = 0) {
 
     typedef typename std::set< Hypothesis<Arc>, HypothesisLess<Arc> > HypothesisSet;
     typedef typename Arc::StateId StateId;
@@ -129,7 +141,7 @@ void BeamTrim(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth)
     // set up the state mapping and other constants
     NaturalLess<Weight> weightLess;
     std::map< StateId, StateId > stateMap;
-    Hypothesis<Arc>::setGlobalId(0);
+    unsigned number = 0;
     ArcMap hasArcs;
     
     // get the current set
@@ -137,13 +149,13 @@ void BeamTrim(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth)
     StateId startState = stateMap[ifst.Start()] = ofst->AddState();
     ofst->SetStart(startState);
     Arc startArc(kNoLabel, kNoLabel, Weight::One(), startState);
-    Hypothesis<Arc> startHyp(startArc, Weight::One(), kNoStateId);
+    Hypothesis<Arc> startHyp(startArc, Weight::One(), kNoStateId, number++);
     currSet->insert(startHyp);
 
     // set the final set of hypotheses to be a single bad one
     HypothesisSet * finalSet = new HypothesisSet;
     Arc finalArc(kNoLabel, kNoLabel, Weight::Zero(), kNoStateId);
-    Hypothesis<Arc> badHyp(finalArc, Weight::Zero(), kNoStateId);
+    Hypothesis<Arc> badHyp(finalArc, Weight::Zero(), kNoStateId, number++);
     finalSet->insert(badHyp);
 
     // while there is still a current hypothesis worth expanding
@@ -229,15 +241,17 @@ void BeamTrim(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth)
             for(ArcIterator< Fst<Arc> > ait(ifst, nextState); !ait.Done(); ait.Next()) {
 
                 const Arc & arc = ait.Value();
-                Hypothesis<Arc> nextHyp(arc, Times(arc.weight, currWeight), nextState, true);//nextBest);
+                Hypothesis<Arc> nextHyp(arc, Times(arc.weight, currWeight), nextState, number++, true);//nextBest);
                 // add to the appropriate stack based on whether an input symbol exists
                 if(weightLess(nextHyp.getWeight(), worstWeight)) {
 #ifdef BEAM_DEBUG
                     cerr << "  Adding hypothesis " << nextHyp << endl;
 #endif
                     ( arc.ilabel ? nextSet : currSet )->insert(nextHyp);
-
-                }
+                    if(counts)
+                        counts->inserted++;
+                } else if(counts)
+                    counts->pruned++;
             }
 
             // trim the next set
@@ -246,6 +260,8 @@ void BeamTrim(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth)
                     cerr << "  Erasing " << *nextSet->rbegin() << endl;
 #endif
                 nextSet->erase(*nextSet->rbegin());
+                if(counts)
+                    counts->pruned++;
             }
 
         }
@@ -269,6 +285,8 @@ void BeamTrim(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth)
 #endif
 
         step++;
+        if(counts)
+            counts->steps++;
 
         delete nextSet;
 
@@ -283,6 +301,389 @@ void BeamTrim(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth)
 
 }
 
+// a hash table from states or pairs of states to values, using open
+//  addressing over flat arrays
+template <class V>
+class StateTable {
+
+public:
+
+    // new entries are given the value init
+    StateTable(const V & init) : keys_(16, kEmpty), values_(16), size_(0), init_(init) { }
+
+    // make a key for a state or a pair of states
+    static uint64 makeKey(int64 state) { return (uint64)state; }
+    static uint64 makeKey(int64 first, int64 second) {
+        return ((uint64)(uint32)first << 32) | (uint32)second;
+    }
+
+    // get the value for a key, adding it if it does not exist
+    V & operator[](uint64 key) {
+        size_t mask = keys_.size() - 1;
+        size_t i = hash(key) & mask;
+        while(keys_[i] != kEmpty) {
+            if(keys_[i] == key)
+                return values_[i];
+            i = (i + 1) & mask;
+        }
+        if((size_ + 1) * 2 > keys_.size()) {
+            grow();
+            return (*this)[key];
+        }
+        keys_[i] = key;
+        values_[i] = init_;
+        size_++;
+        return values_[i];
+    }
+
+private:
+
+    // no arc ends in kNoStateId, and no state is -1 when not paired, so
+    //  this key is never used
+    static const uint64 kEmpty = ~(uint64)0;
+
+    static size_t hash(uint64 key) {
+        key *= 0x9E3779B97F4A7C15ULL;
+        return (size_t)(key ^ (key >> 32));
+    }
+
+    void grow() {
+        std::vector<uint64> keys;
+        std::vector<V> values;
+        keys.swap(keys_);
+        values.swap(values_);
+        keys_.resize(keys.size() * 2, kEmpty);
+        values_.resize(keys.size() * 2);
+        size_t mask = keys_.size() - 1;
+        for(size_t j = 0; j < keys.size(); j++) {
+            if(keys[j] == kEmpty)
+                continue;
+            size_t i = hash(keys[j]) & mask;
+            while(keys_[i] != kEmpty)
+                i = (i + 1) & mask;
+            keys_[i] = keys[j];
+            values_[i] = values[j];
+        }
+    }
+
+    std::vector<uint64> keys_;
+    std::vector<V> values_;
+    size_t size_;
+    V init_;
+
+};
+
+template <class V>
+const uint64 StateTable<V>::kEmpty;
+
+// The state of a beam trim over contiguous storage. Hypotheses are kept in
+//  a pool and the two stacks are heaps of indices into it: the current stack
+//  is a min-heap that is popped in order, and the next stack is a max-heap
+//  holding at most beamWidth hypotheses with the worst on top. Ties between
+//  equal weights are broken by the order in which the hypotheses were made,
+//  so the output is exactly that of SetBeamTrim. 
+// A threshold can also be given, in which case hypotheses are dropped when
+//  they are not better than Times(best, threshold), where best is the best
+//  hypothesis of the same step. This is checked before hypotheses are added,
+//  so arcs out of unpromising states are never expanded.
+// With recombination, only the best hypothesis in each state is kept at each
+//  step, so the beam holds distinct states. The arcs of the hypotheses that
+//  are merged away are still added to the output, so the n-best paths
+//  through them can be found, but their states are expanded only once.
+template <class Arc>
+class FlatBeamTrimmer {
+
+public:
+
+    typedef typename Arc::StateId StateId;
+    typedef typename Arc::Weight Weight;
+
+    FlatBeamTrimmer(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth,
+                    BeamTrimCounts * counts, const Weight & threshold, bool recombine) :
+        ifst_(ifst), ofst_(ofst), beamWidth_(beamWidth), counts_(counts), threshold_(threshold),
+        recombine_(recombine), number_(0), stateMap_(kNoStateId), hasArcs_(0),
+        recombinedArcs_(Arc()), expanded_(0), bestNext_(std::pair<unsigned,unsigned>(0, 0)) { }
+
+    void trim();
+
+private:
+
+    struct Hyp {
+        Arc arc;
+        Weight weight;
+        StateId state;
+        unsigned number;
+        // false once the hypothesis has been dropped from the next stack
+        bool live;
+    };
+
+    // the order of hypotheses, with the best first
+    class HypLess {
+    public:
+        HypLess(const std::vector<Hyp> & pool) : pool_(pool) { }
+        bool operator()(unsigned a, unsigned b) const {
+            const Hyp & h1 = pool_[a], & h2 = pool_[b];
+            if(less_(h1.weight, h2.weight))
+                return true;
+            else if(less_(h2.weight, h1.weight))
+                return false;
+            return h1.number < h2.number;
+        }
+    private:
+        const std::vector<Hyp> & pool_;
+        NaturalLess<Weight> less_;
+    };
+
+    // the order of the current min-heap, with the best on top
+    class HypGreater {
+    public:
+        HypGreater(const std::vector<Hyp> & pool) : less_(pool) { }
+        bool operator()(unsigned a, unsigned b) const { return less_(b, a); }
+    private:
+        HypLess less_;
+    };
+
+    // get the output state for an input state, adding it if necessary
+    StateId getState(StateId state) {
+        StateId & ret = stateMap_[stateMap_.makeKey(state)];
+        if(ret == kNoStateId)
+            ret = ofst_->AddState();
+        return ret;
+    }
+
+    // add the arc of a hypothesis to the output
+    void addArc(const Hyp & hyp) {
+        Arc ofstArc = hyp.arc;
+        StateId ofstState = getState(hyp.state);
+        ofstArc.nextstate = getState(hyp.arc.nextstate);
+        ofst_->AddArc(ofstState, ofstArc);
+        const Weight & finalWeight = ifst_.Final(hyp.arc.nextstate);
+        if(finalWeight != Weight::Zero())
+            ofst_->SetFinal(ofstArc.nextstate, finalWeight);
+    }
+
+    // add the arc of a hypothesis that was merged into a better one, unless
+    //  an arc between the same states has already been added
+    void addRecombinedArc(const Hyp & hyp) {
+        uint64 key = hasArcs_.makeKey(hyp.state, hyp.arc.nextstate);
+        unsigned & arcStep = hasArcs_[key];
+        if(arcStep == 0) {
+            arcStep = kRecombinedArc;
+            recombinedArcs_[key] = hyp.arc;
+            addArc(hyp);
+        }
+        if(counts_)
+            counts_->recombined++;
+    }
+
+    // whether an arc is the same as one that has already been added
+    static bool sameArc(const Arc & a1, const Arc & a2) {
+        return a1.ilabel == a2.ilabel && a1.olabel == a2.olabel
+            && a1.nextstate == a2.nextstate && a1.weight == a2.weight;
+    }
+
+    // marks arcs in hasArcs_ that were added for merged hypotheses, which
+    //  only stop the arc of a surviving hypothesis from being added if it
+    //  is the same arc
+    static const unsigned kRecombinedArc = ~0u;
+
+    const Fst<Arc> & ifst_;
+    MutableFst<Arc> * ofst_;
+    unsigned beamWidth_;
+    BeamTrimCounts * counts_;
+    Weight threshold_;
+    bool recombine_;
+    // the number of hypotheses made, used to break ties
+    unsigned number_;
+    // the output state of each input state
+    StateTable<StateId> stateMap_;
+    // the step in which an arc between two states was last added
+    StateTable<unsigned> hasArcs_;
+    // the arc added between two states for a merged hypothesis
+    StateTable<Arc> recombinedArcs_;
+    // the step in which each state was last expanded
+    StateTable<unsigned> expanded_;
+    // the step and pool index of the best hypothesis leading into each state
+    //  in the next stack
+    StateTable< std::pair<unsigned,unsigned> > bestNext_;
+
+};
+
+template <class Arc>
+const unsigned FlatBeamTrimmer<Arc>::kRecombinedArc;
+
+template <class Arc>
+void FlatBeamTrimmer<Arc>::trim() {
+
+    NaturalLess<Weight> weightLess;
+    std::vector<Hyp> pool, nextPool;
+    std::vector<unsigned> currHeap, nextHeap;
+    HypLess nextLess(pool);
+    HypGreater currGreater(pool);
+
+    // start with a hypothesis leading into the start state, numbered as if
+    //  SetBeamTrim's two initial hypotheses had been made
+    ofst_->SetStart(getState(ifst_.Start()));
+    Hyp startHyp;
+    startHyp.arc = Arc(kNoLabel, kNoLabel, Weight::One(), ifst_.Start());
+    startHyp.weight = Weight::One();
+    startHyp.state = kNoStateId;
+    startHyp.number = number_++;
+    startHyp.live = true;
+    number_++;
+    pool.push_back(startHyp);
+    currHeap.push_back(0);
+
+    unsigned step = 1;
+    while(currHeap.size() > 0 && weightLess(pool[currHeap.front()].weight, Weight::Zero())) {
+
+        // the thresholds for this step and the next, which are zero (and
+        //  thus have no effect) when no threshold is set
+        Weight currBound = Times(pool[currHeap.front()].weight, threshold_);
+        Weight nextBound = Weight::Zero();
+        Weight bestNext = Weight::Zero();
+        // the number of hypotheses in the next stack that have not been
+        //  dropped, which is its size when there is no recombination
+        unsigned nextLive = 0;
+
+        // until the next stack is full, its worst weight is zero
+        while(currHeap.size() > 0) {
+
+            // pop the best hypothesis, stopping if it falls outside the beam
+            unsigned currIdx = currHeap.front();
+            std::pop_heap(currHeap.begin(), currHeap.end(), currGreater);
+            currHeap.pop_back();
+            Weight worstWeight = (nextLive < beamWidth_ ? Weight::Zero() : pool[nextHeap.front()].weight);
+            if(!weightLess(pool[currIdx].weight, worstWeight) || !weightLess(pool[currIdx].weight, currBound))
+                break;
+
+            // merge hypotheses into states that have already been expanded
+            //  this step by a better one
+            const Hyp currHyp = pool[currIdx];
+            StateId currState = currHyp.state;
+            StateId nextState = currHyp.arc.nextstate;
+            if(recombine_) {
+                unsigned & expandStep = expanded_[expanded_.makeKey(nextState)];
+                if(expandStep == step) {
+                    addRecombinedArc(currHyp);
+                    continue;
+                }
+                expandStep = step;
+            }
+
+            // skip arcs that have already been added this step. An arc added
+            //  for a merged hypothesis is only the same as this one if it
+            //  has the same labels and weight, as there may be several arcs
+            //  between the two states
+            uint64 arcKey = hasArcs_.makeKey(currState, nextState);
+            unsigned & arcStep = hasArcs_[arcKey];
+            bool arcExists = (arcStep != 0 &&
+                (arcStep != kRecombinedArc || sameArc(recombinedArcs_[arcKey], currHyp.arc)));
+            if(arcStep == step)
+                continue;
+            arcStep = step;
+            if(!arcExists && currState != kNoStateId)
+                addArc(currHyp);
+
+            // add new hypotheses for all the arcs in the state
+            for(ArcIterator< Fst<Arc> > ait(ifst_, nextState); !ait.Done(); ait.Next()) {
+                const Arc & arc = ait.Value();
+                Hyp nextHyp;
+                nextHyp.arc = arc;
+                nextHyp.weight = Times(arc.weight, currHyp.weight);
+                nextHyp.state = nextState;
+                nextHyp.number = number_++;
+                nextHyp.live = true;
+                if(weightLess(nextHyp.weight, worstWeight) && 
+                   weightLess(nextHyp.weight, (arc.ilabel ? nextBound : currBound))) {
+                    if(arc.ilabel && recombine_) {
+                        // keep only the better of two hypotheses in the same
+                        //  state, unless the other has already been dropped
+                        std::pair<unsigned,unsigned> & best = bestNext_[bestNext_.makeKey(arc.nextstate)];
+                        if(best.first == step && pool[best.second].live) {
+                            Hyp & other = pool[best.second];
+                            if(!weightLess(nextHyp.weight, other.weight)) {
+                                if(other.state != nextState)
+                                    addRecombinedArc(nextHyp);
+                                continue;
+                            }
+                            other.live = false;
+                            nextLive--;
+                            if(other.state != nextState)
+                                addRecombinedArc(other);
+                        }
+                        best = std::pair<unsigned,unsigned>(step, pool.size());
+                    }
+                    pool.push_back(nextHyp);
+                    if(arc.ilabel) {
+                        // tighten the threshold when the best improves
+                        if(threshold_ != Weight::Zero() && weightLess(nextHyp.weight, bestNext)) {
+                            bestNext = nextHyp.weight;
+                            nextBound = Times(bestNext, threshold_);
+                        }
+                        nextHeap.push_back(pool.size() - 1);
+                        std::push_heap(nextHeap.begin(), nextHeap.end(), nextLess);
+                        nextLive++;
+                    } else {
+                        currHeap.push_back(pool.size() - 1);
+                        std::push_heap(currHeap.begin(), currHeap.end(), currGreater);
+                    }
+                    if(counts_)
+                        counts_->inserted++;
+                } else if(counts_)
+                    counts_->pruned++;
+            }
+
+            // trim the next stack, and remove dropped hypotheses from the
+            //  top so that it always holds the worst live hypothesis
+            while(nextHeap.size() > 0 && (nextLive > beamWidth_ || !pool[nextHeap.front()].live)) {
+                Hyp & worst = pool[nextHeap.front()];
+                std::pop_heap(nextHeap.begin(), nextHeap.end(), nextLess);
+                nextHeap.pop_back();
+                if(worst.live) {
+                    worst.live = false;
+                    nextLive--;
+                    if(counts_)
+                        counts_->pruned++;
+                }
+            }
+
+        }
+
+        // move the survivors into a fresh pool to become the current stack
+        nextPool.clear();
+        currHeap.clear();
+        for(unsigned i = 0; i < nextHeap.size(); i++) {
+            if(pool[nextHeap[i]].live) {
+                currHeap.push_back(nextPool.size());
+                nextPool.push_back(pool[nextHeap[i]]);
+            }
+        }
+        pool.swap(nextPool);
+        nextHeap.clear();
+        std::make_heap(currHeap.begin(), currHeap.end(), currGreater);
+
+        step++;
+        if(counts_)
+            counts_->steps++;
+
+    }
+
+}
+
+// do a beam-search type trim, aligning the number of non-epsilon input symbols.
+//  At most beamWidth hypotheses are kept at each step, and if a threshold is
+//  given, only those better than Times(best, threshold). If recombine is true,
+//  only the best hypothesis in each state is kept at each step.
+template <class Arc>
+void BeamTrim(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth,
+              BeamTrimCounts * counts = 0, 
+              const typename Arc::Weight & threshold = Arc::Weight::Zero(),
+              bool recombine = false) {
+    FlatBeamTrimmer<Arc> trimmer(ifst, ofst, beamWidth, counts, threshold, recombine);
+    trimmer.trim();
+}
+
 }
 
 #endif // BEAM_TRIM_H__
@@ -0,0 +1,145 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// component-kernels.h
+//
+//  Loops over the component arrays of ComponentWeights. Each operation has
+//   a scalar version and a vector version that uses AVX or SSE when the
+//   compiler targets them (for example with ./configure --enable-native),
+//   falling back to the scalar version for the remaining components. Both
+//   give exactly the same results.
+
+#ifndef KYFD_COMPONENT_KERNELS_H__
+#define KYFD_COMPONENT_KERNELS_H__
+
+#include <cmath>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+namespace fst {
+
+// c3 = c1 + c2
+inline void AddComponentsScalar(unsigned short width, const float* c1, const float* c2, float* c3) {
+    for(unsigned short i = 0; i < width; i++)
+        c3[i] = c1[i] + c2[i];
+}
+
+// c3 = c1 - c2
+inline void SubtractComponentsScalar(unsigned short width, const float* c1, const float* c2, float* c3) {
+    for(unsigned short i = 0; i < width; i++)
+        c3[i] = c1[i] - c2[i];
+}
+
+// c3 = 0 - c1
+inline void NegateComponentsScalar(unsigned short width, const float* c1, float* c3) {
+    for(unsigned short i = 0; i < width; i++)
+        c3[i] = 0.0F - c1[i];
+}
+
+// c3 = c1 rounded to the nearest multiple of delta
+inline void QuantizeComponentsScalar(unsigned short width, const float* c1, float* c3, float delta) {
+    for(unsigned short i = 0; i < width; i++)
+        c3[i] = std::floor(c1[i] / delta + 0.5F) * delta;
+}
+
+inline void AddComponentsVector(unsigned short width, const float* c1, const float* c2, float* c3) {
+    unsigned short i = 0;
+#if defined(__AVX__)
+    for( ; i + 8 <= width; i += 8)
+        _mm256_storeu_ps(c3+i, _mm256_add_ps(_mm256_loadu_ps(c1+i), _mm256_loadu_ps(c2+i)));
+#endif
+#if defined(__SSE__)
+    for( ; i + 4 <= width; i += 4)
+        _mm_storeu_ps(c3+i, _mm_add_ps(_mm_loadu_ps(c1+i), _mm_loadu_ps(c2+i)));
+#endif
+    AddComponentsScalar(width-i, c1+i, c2+i, c3+i);
+}
+
+inline void SubtractComponentsVector(unsigned short width, const float* c1, const float* c2, float* c3) {
+    unsigned short i = 0;
+#if defined(__AVX__)
+    for( ; i + 8 <= width; i += 8)
+        _mm256_storeu_ps(c3+i, _mm256_sub_ps(_mm256_loadu_ps(c1+i), _mm256_loadu_ps(c2+i)));
+#endif
+#if defined(__SSE__)
+    for( ; i + 4 <= width; i += 4)
+        _mm_storeu_ps(c3+i, _mm_sub_ps(_mm_loadu_ps(c1+i), _mm_loadu_ps(c2+i)));
+#endif
+    SubtractComponentsScalar(width-i, c1+i, c2+i, c3+i);
+}
+
+inline void NegateComponentsVector(unsigned short width, const float* c1, float* c3) {
+    unsigned short i = 0;
+#if defined(__AVX__)
+    for( ; i + 8 <= width; i += 8)
+        _mm256_storeu_ps(c3+i, _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(c1+i)));
+#endif
+#if defined(__SSE__)
+    for( ; i + 4 <= width; i += 4)
+        _mm_storeu_ps(c3+i, _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(c1+i)));
+#endif
+    NegateComponentsScalar(width-i, c1+i, c3+i);
+}
+
+// rounding down needs SSE4.1 or AVX
+inline void QuantizeComponentsVector(unsigned short width, const float* c1, float* c3, float delta) {
+    unsigned short i = 0;
+#if defined(__AVX__)
+    __m256 delta8 = _mm256_set1_ps(delta), half8 = _mm256_set1_ps(0.5F);
+    for( ; i + 8 <= width; i += 8) {
+        __m256 v = _mm256_add_ps(_mm256_div_ps(_mm256_loadu_ps(c1+i), delta8), half8);
+        _mm256_storeu_ps(c3+i, _mm256_mul_ps(_mm256_floor_ps(v), delta8));
+    }
+#endif
+#if defined(__SSE4_1__)
+    __m128 delta4 = _mm_set1_ps(delta), half4 = _mm_set1_ps(0.5F);
+    for( ; i + 4 <= width; i += 4) {
+        __m128 v = _mm_add_ps(_mm_div_ps(_mm_loadu_ps(c1+i), delta4), half4);
+        _mm_storeu_ps(c3+i, _mm_mul_ps(_mm_floor_ps(v), delta4));
+    }
+#endif
+    QuantizeComponentsScalar(width-i, c1+i, c3+i, delta);
+}
+
+// add components with the width known at compile time, so the loop can be
+//  unrolled
+template <unsigned short N>
+inline void AddComponents(const float* c1, const float* c2, float* c3) {
+    AddComponentsVector(N, c1, c2, c3);
+}
+
+// add components, choosing one of the fixed-width versions for the widths
+//  that are used in practice
+inline void AddComponents(unsigned short width, const float* c1, const float* c2, float* c3) {
+#define COMPONENT_ADD_CASE(N) case N: AddComponents<N>(c1, c2, c3); return;
+    switch(width) {
+        COMPONENT_ADD_CASE(1)  COMPONENT_ADD_CASE(2)  COMPONENT_ADD_CASE(3)  COMPONENT_ADD_CASE(4)
+        COMPONENT_ADD_CASE(5)  COMPONENT_ADD_CASE(6)  COMPONENT_ADD_CASE(7)  COMPONENT_ADD_CASE(8)
+        COMPONENT_ADD_CASE(9)  COMPONENT_ADD_CASE(10) COMPONENT_ADD_CASE(11) COMPONENT_ADD_CASE(12)
+        COMPONENT_ADD_CASE(13) COMPONENT_ADD_CASE(14) COMPONENT_ADD_CASE(15) COMPONENT_ADD_CASE(16)
+        default:
+            AddComponentsVector(width, c1, c2, c3);
+    }
+#undef COMPONENT_ADD_CASE
+}
+
+}
+
+#endif // KYFD_COMPONENT_KERNELS_H__
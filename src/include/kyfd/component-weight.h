@@ -16,15 +16,20 @@
 // component-weight.h
 //
 //  A weight on the component semi-ring, a version of the tropical semiring
-//   that is able to hold several components separately.
+//   that is able to hold several components separately. Components are held
+//   inside the weight up to COMPONENT_INLINE_WIDTH, so copying and
+//   multiplying weights does not allocate memory.
 
 #ifndef FST_LIB_COMPONENT_WEIGHT_H__
 #define FST_LIB_COMPONENT_WEIGHT_H__
 
 #include <fst/float-weight.h>
 #include <stdexcept>
+#include <cstring>
+#include <vector>
 // #include <kyfd/components.h>
 #include <kyfd/util.h>
+#include <kyfd/component-kernels.h>
 
 // #define DEBUG_COMPONENT
 
@@ -37,111 +42,115 @@ namespace fst {
 class ComponentWeight;
 inline ostream& operator<<(ostream& strm, const ComponentWeight &w);
 
+// the number of components that are stored inside the weight itself, wider
+//  weights are stored on the heap. The default of six fits five models and
+//  keeps the weight at 32 bytes
+#ifndef COMPONENT_INLINE_WIDTH
+#define COMPONENT_INLINE_WIDTH 6
+#endif
+
 // Tropical semiring with tracking capability for all the individual weights
 class ComponentWeight {
 
 private:
     
-    // a pointer to an array including count, width, data
-    unsigned short* ptr_;
-    // unsigned short count_;
-    // unsigned short width_;
-    // float* components_;
+    // the components, held in place unless there are more than INLINE_WIDTH
+    union {
+        float inline_[COMPONENT_INLINE_WIDTH];
+        float* heap_;
+    } data_;
+    unsigned short width_;
+
+    bool isInline() const { return width_ <= INLINE_WIDTH; }
+
+    // set the width, allocating space for the components if necessary,
+    //  which are left uninitialized
+    void init(unsigned short width) {
+        width_ = width;
+        if(!isInline())
+            data_.heap_ = new float[width];
+    }
+
+    void release() {
+        if(!isInline())
+            delete [] data_.heap_;
+        width_ = 0;
+    }
 
 public:
 
     typedef ComponentWeight ReverseWeight;
     const static unsigned short BAD_INDEX = UCHAR_MAX;
+    const static unsigned short INLINE_WIDTH = COMPONENT_INLINE_WIDTH;
     
-    ComponentWeight() : ptr_(0) {}
+    ComponentWeight() : width_(0) {}
 
     ComponentWeight(float component) {
-        ptr_ = new unsigned short[sizeof(float)/2+2];
-        ptr_[0] = 1;
-        ptr_[1] = 1;
-        setComponent(0, component);
+        init(1);
+        data_.inline_[0] = component;
     }
 
-    ComponentWeight(unsigned short width, const float* components) : ptr_(0) {
-        if(width > 0) {
-            ptr_ = new unsigned short[width*sizeof(float)/2+2];
-            ptr_[0] = 1;
-            ptr_[1] = width;
-            memcpy(ptr_+2, components, width*sizeof(float));
-            // std::cerr << "Created(w,c) [" << (unsigned long)ptr_ << "] = " << (int)ptr_[0] << ", " <<(int)ptr_[1] << " = " << *this << std::endl;
-        }
+    ComponentWeight(unsigned short width, const float* components) {
+        init(width);
+        if(width > 0)
+            memcpy(getComponents(), components, width*sizeof(float));
     }
 
+    // inline components are copied as a whole, which takes a fixed number
+    //  of instructions whatever the width
     ComponentWeight(const ComponentWeight &w) {
-        ptr_ = w.ptr_;
-        if(ptr_ != 0) {
-            ptr_[0]++;
-            if(ptr_[0] == 65535) {
-                unsigned short * newPtr = new unsigned short[ptr_[1]*sizeof(float)/2+2];
-                memcpy(newPtr, ptr_, ptr_[1]*sizeof(float)+4);
-                ptr_[0]--;
-                newPtr[0] = 1;
-                ptr_ = newPtr;
-            }
-            // std::cerr << "Created(w) [" << (unsigned long)ptr_ << "] = " << (int)ptr_[0] << ", " <<(int)ptr_[1] << " = " << *this << std::endl;
+        if(w.isInline()) {
+            data_ = w.data_;
+            width_ = w.width_;
+        } else {
+            init(w.width_);
+            memcpy(data_.heap_, w.data_.heap_, width_*sizeof(float));
         }
     }
 
     ComponentWeight &operator=(const ComponentWeight &w) {
-        if(ptr_ && (0 == --ptr_[0]))
-            delete [] ptr_;
-        ptr_ = w.ptr_;
-        if(ptr_ != 0) {
-            ++ptr_[0];
-            if(ptr_[0] == 65535) {
-                unsigned short * newPtr = new unsigned short[ptr_[1]*sizeof(float)/2+2];
-                memcpy(newPtr, ptr_, ptr_[1]*sizeof(float)+4);
-                ptr_[0]--;
-                newPtr[0] = 1;
-                ptr_ = newPtr;
+        if(this != &w) {
+            if(w.isInline()) {
+                release();
+                data_ = w.data_;
+                width_ = w.width_;
+            } else {
+                if(width_ != w.width_) {
+                    release();
+                    init(w.width_);
+                }
+                memcpy(data_.heap_, w.data_.heap_, width_*sizeof(float));
             }
-            // std::cerr << "=(w) [" << (unsigned long)ptr_ << "] = " << (int)ptr_[0] << ", " <<(int)ptr_[1] << " = " << *this << std::endl;
         }
         return *this;
     }
 
     ~ComponentWeight() {
-        if(ptr_ != 0) {
-            // std::cerr << "Deleting [" << (unsigned long)ptr_ << "] = " << (int)ptr_[0] << ", " <<(int)ptr_[1] << " = " << *this << std::endl;
-            if(--ptr_[0] == 0) {
-                delete [] ptr_;
-                ptr_ = 0;
-            }
-        }
+        release();
     }
 
     // accessors
-    inline unsigned short getWidth() const { return (ptr_?ptr_[1]:0); }
+    inline unsigned short getWidth() const { return width_; }
     inline float getComponent(unsigned short i) const {
-        if(!ptr_ || i >= ptr_[1])
+        if(i >= width_)
             throw runtime_error("Bad read of component");
         else
-            return ((float*)(ptr_+2))[i];
+            return getComponents()[i];
     }
 
+    // direct access to the components, of which there are getWidth()
+    inline const float* getComponents() const { return isInline() ? data_.inline_ : data_.heap_; }
+    inline float* getComponents() { return isInline() ? data_.inline_ : data_.heap_; }
+
     // set a particular component
-    inline float setComponent(unsigned short i, float f) {
-        if(ptr_ || i >= ptr_[1]) {
-            if(ptr_[0] != 1) {
-                unsigned short * newPtr = new unsigned short[ptr_[1]*sizeof(float)/2+2];
-                memcpy(newPtr, ptr_, ptr_[1]*sizeof(float)+4);
-                ptr_[0]--;
-                newPtr[0] = 1;
-                ptr_ = newPtr;
-            }
-            ((float*)(ptr_+2))[i] = f;
-        }
-        else
+    inline void setComponent(unsigned short i, float f) {
+        if(i >= width_)
             throw runtime_error("Attempt to set component for uninitialized value");
+        getComponents()[i] = f;
     }
 
     // set the value of the component
-    inline float Value() const { return (getWidth()>0?getComponent(0):0.0F); }
+    inline float Value() const { return (width_>0?getComponents()[0]:0.0F); }
 
     // Check that it works
     bool Member() const {
@@ -152,35 +161,26 @@ public:
       return ComponentWeight(FloatLimits<float>::NumberBad()); }
       
     istream &Read(istream &strm) {
-        if(ptr_ && (--ptr_[0] != 0)) {
-            delete [] ptr_;
-            ptr_ = 0;
-        }
+        release();
         unsigned short width;
         ReadType(strm, &width);
-        if(width > 0) {
-            ptr_ = new unsigned short[width*sizeof(float)/2+2];
-            ptr_[0] = 1;
-            ptr_[1] = width;
-            float * fptr_ = (float*)(ptr_+2);
-            for(unsigned short i = 0; i < width; i++)
-                ReadType(strm, fptr_ + i);
-        }
+        init(width);
+        float * comps = getComponents();
+        for(unsigned short i = 0; i < width; i++)
+            ReadType(strm, comps + i);
         return strm;
     }
     
     ostream &Write(ostream &strm) const {
-        unsigned short width = getWidth();
-        WriteType(strm, width);
-        float * fptr_ = (float*)(ptr_+2);
-        for(unsigned short i = 0; i < width; i++)
-            WriteType(strm, fptr_[i]);
+        WriteType(strm, width_);
+        const float * comps = getComponents();
+        for(unsigned short i = 0; i < width_; i++)
+            WriteType(strm, comps[i]);
         return strm;
     }
 
     static const ComponentWeight Zero() {
-        float comp[] = { FloatLimits<float>::PosInfinity() };
-        return ComponentWeight(1, comp);
+        return ComponentWeight(FloatLimits<float>::PosInfinity());
     }
   
     static const ComponentWeight One() {
@@ -189,9 +189,7 @@ public:
 
     ComponentWeight Quantize(float delta = kDelta) const {
         ComponentWeight result(*this);
-        unsigned short width = getWidth();
-        for(unsigned short i = 0; i < width; i++)
-            result.setComponent(i, floor( getComponent(i) / delta+0.5F) * delta);
+        QuantizeComponentsVector(width_, getComponents(), result.getComponents(), delta);
         return result;
     }
 
@@ -215,6 +213,9 @@ public:
         return u.s;
     }
 
+    friend ComponentWeight Times(const ComponentWeight &w1, const ComponentWeight &w2);
+    friend ComponentWeight Divide(const ComponentWeight &w1, const ComponentWeight &w2, DivideType typ);
+
 };
 
 // print to a stream
@@ -245,13 +246,11 @@ inline istream &operator>>(istream &strm, ComponentWeight &w) {
     if(s[0] != '[' || s[s.length()-1] != ']')
         throw runtime_error("Format error in components");
     string compStr = s.substr(1, s.length()-2);
-    unsigned width = 1;
-    for(unsigned i = 0; i < compStr.size(); i++)
-        if(compStr[i] == ',') width++;
+    vector<float> comps;
     char delims[] = ",";
-    unsigned curr = 0;
     for(char* tok = strtok( (char*)compStr.c_str(), delims ); tok != 0; tok = strtok(0, delims) )
-        w.setComponent(curr++, kyfd::stringToFloat(tok) );
+        comps.push_back( kyfd::stringToFloat(tok) );
+    w = ComponentWeight(comps.size(), (comps.size() ? &comps[0] : 0));
     return strm;
 }
 
@@ -259,9 +258,9 @@ inline bool operator==(const ComponentWeight &w1,
                        const ComponentWeight &w2) {
     if(w1.getWidth() != w2.getWidth())
         return false;
+    const float * c1 = w1.getComponents(), * c2 = w2.getComponents();
     for(unsigned short i = 0; i < w1.getWidth(); i++) {
-        // // std::cerr << "getComponent("<<i<<"): "<<w1.getComponent(i)<<", "<<w2.getComponent(i)<<std::endl;
-        if(w1.getComponent(i) != w2.getComponent(i))
+        if(c1[i] != c2[i])
             return false;
     }
     return true;
@@ -282,13 +281,17 @@ inline ComponentWeight Times(const ComponentWeight &w1, const ComponentWeight &w
     else if(w2.Value() == FloatLimits<float>::PosInfinity())
         return w2;
     else {
-        unsigned short s3 = max( s1, s2 );
-        float c3[s3];
-        for(unsigned short i = 0; i < s3; i++) {
-            c3[i] = (i < s1 ? w1.getComponent(i) : 0.0F ) + (i < s2 ? w2.getComponent(i) : 0.0F );
-            // // std::cerr << "c3["<<i<<"]="<<w1.getComponent(i)<<"+"<<w2.getComponent(i)<<"="<<c3[i] << std::endl;
-        }
-        ComponentWeight w3(s3, c3);
+        // add the shared components, then copy the rest of the wider weight
+        ComponentWeight w3;
+        w3.init(max( s1, s2 ));
+        const float * c1 = w1.getComponents(), * c2 = w2.getComponents();
+        float * c3 = w3.getComponents();
+        unsigned short shared = min( s1, s2 );
+        AddComponents(shared, c1, c2, c3);
+        if(s1 > shared)
+            memcpy(c3 + shared, c1 + shared, (s1-shared)*sizeof(float));
+        else if(s2 > shared)
+            memcpy(c3 + shared, c2 + shared, (s2-shared)*sizeof(float));
         return w3;
     }
 }
@@ -299,15 +302,34 @@ inline ComponentWeight Plus(const ComponentWeight &w1, const ComponentWeight &w2
 
 inline ComponentWeight OneOver(const ComponentWeight &w1){
     ComponentWeight result(w1);
-    for(unsigned short i = 0; i < result.getWidth(); i++)
-        result.setComponent(i, 0.0F - result.getComponent(i));
+    NegateComponentsVector(w1.getWidth(), w1.getComponents(), result.getComponents());
     return result;
 }
 
 inline ComponentWeight Divide(const ComponentWeight &w1,
                               const ComponentWeight &w2,
                               DivideType typ = DIVIDE_ANY) {
-    return Times(w1, OneOver(w2));
+    // the same as Times(w1, OneOver(w2)), without making the inverse
+    unsigned short s1 = w1.getWidth(), s2 = w2.getWidth();
+    if(s1 == 0)
+        return OneOver(w2);
+    else if(s2 == 0 || w1.Value() == FloatLimits<float>::PosInfinity())
+        return w1;
+    else if(0.0F - w2.Value() == FloatLimits<float>::PosInfinity())
+        return OneOver(w2);
+    else {
+        ComponentWeight w3;
+        w3.init(max( s1, s2 ));
+        const float * c1 = w1.getComponents(), * c2 = w2.getComponents();
+        float * c3 = w3.getComponents();
+        unsigned short shared = min( s1, s2 );
+        SubtractComponentsVector(shared, c1, c2, c3);
+        if(s1 > shared)
+            memcpy(c3 + shared, c1 + shared, (s1-shared)*sizeof(float));
+        else if(s2 > shared)
+            NegateComponentsVector(s2-shared, c2 + shared, c3 + shared);
+        return w3;
+    }
 }
 
 inline bool ApproxEqual(const ComponentWeight &w1,
@@ -0,0 +1,85 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// context-fst.h
+//
+//  A non-owning view of a model that is used by a single decoding context.
+//   OpenFst's reference counts (for FST implementations and symbol tables)
+//   are not thread-safe, so composition must never copy the shared model
+//   itself. Copying this view touches no shared counts, and symbol tables
+//   are hidden as the decoder uses the ones from its configuration.
+
+#ifndef KYFD_CONTEXT_FST_H__
+#define KYFD_CONTEXT_FST_H__
+
+#include <fst/fst.h>
+
+namespace fst {
+
+template <class A>
+class ContextFst : public Fst<A> {
+
+public:
+
+    typedef A Arc;
+    typedef typename A::Weight Weight;
+    typedef typename A::StateId StateId;
+
+    // wrap an FST, which must outlive this object. If shared is true, the
+    //  FST is used by other threads, so its properties will never be tested
+    //  (and thus written) through this view
+    ContextFst(const Fst<A> & fst, bool shared) : fst_(&fst), shared_(shared) { }
+
+    ContextFst(const ContextFst<A> & fst) : fst_(fst.fst_), shared_(fst.shared_) { }
+
+    StateId Start() const { return fst_->Start(); }
+    Weight Final(StateId s) const { return fst_->Final(s); }
+    size_t NumArcs(StateId s) const { return fst_->NumArcs(s); }
+    size_t NumInputEpsilons(StateId s) const { return fst_->NumInputEpsilons(s); }
+    size_t NumOutputEpsilons(StateId s) const { return fst_->NumOutputEpsilons(s); }
+
+    uint64 Properties(uint64 mask, bool test) const {
+        return fst_->Properties(mask, test && !shared_);
+    }
+
+    const string& Type() const { return fst_->Type(); }
+
+    ContextFst<A> * Copy(bool safe = false) const {
+        return new ContextFst<A>(*this);
+    }
+
+    const SymbolTable* InputSymbols() const { return 0; }
+    const SymbolTable* OutputSymbols() const { return 0; }
+
+    void InitStateIterator(StateIteratorData<A> *data) const {
+        fst_->InitStateIterator(data);
+    }
+
+    void InitArcIterator(StateId s, ArcIteratorData<A> *data) const {
+        fst_->InitArcIterator(s, data);
+    }
+
+private:
+
+    const Fst<A> * fst_;
+    bool shared_;
+
+    void operator=(const ContextFst<A> &);     // disallow
+
+};
+
+}
+
+#endif // KYFD_CONTEXT_FST_H__
@@ -0,0 +1,58 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// decode-server.h
+//
+//  A server that keeps the models loaded and decodes sentences sent by
+//   local clients over a Unix domain socket. Each client gets its own
+//   thread and context. Requests are sentences in the same format as the
+//   decoder's standard input. Each response starts with a line holding the
+//   number of output lines that follow, or a line starting with "ERROR "
+//   if the sentence could not be decoded.
+
+#ifndef KYFD_DECODE_SERVER_H__
+#define KYFD_DECODE_SERVER_H__
+
+#include <string>
+#include <kyfd/decoder.h>
+
+namespace kyfd {
+
+class DecodeServer {
+
+public:
+
+    DecodeServer(Decoder & decoder, const std::string & path);
+
+    ~DecodeServer();
+
+    // accept clients until an error occurs
+    void serve();
+
+private:
+
+    // the function run for each client
+    static void* runClient(void* ptr);
+    void handleClient(int fd);
+
+    Decoder & decoder_;
+    std::string path_;
+    int socket_;
+
+};
+
+}
+
+#endif // KYFD_DECODE_SERVER_H__
@@ -0,0 +1,192 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// decode-stats.h
+//
+//  Wall-clock and CPU time spent in each stage of decoding, with latency
+//   histograms to find percentiles
+
+#ifndef KYFD_DECODE_STATS_H__
+#define KYFD_DECODE_STATS_H__
+
+#include <vector>
+#include <iostream>
+#include <ctime>
+
+namespace kyfd {
+
+// the stages of decoding a single sentence, other than composition which is
+//  timed separately for each model
+typedef enum { INPUT_STAGE, TRIM_STAGE, DEDUP_STAGE, SEARCH_STAGE, OUTPUT_STAGE, NUM_STAGES } DecodeStage;
+
+// measures monotonic wall-clock time and the CPU time of the calling thread
+class StageTimer {
+
+public:
+
+    StageTimer() { reset(); }
+
+    void reset() {
+        wall_ = getTime(CLOCK_MONOTONIC);
+        cpu_ = getTime(CLOCK_THREAD_CPUTIME_ID);
+    }
+
+    // get the time since the last reset, and reset
+    void lap(double & wall, double & cpu) {
+        double currWall = getTime(CLOCK_MONOTONIC);
+        double currCpu = getTime(CLOCK_THREAD_CPUTIME_ID);
+        wall = currWall - wall_;
+        cpu = currCpu - cpu_;
+        wall_ = currWall;
+        cpu_ = currCpu;
+    }
+
+    static double getTime(clockid_t clock) {
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+private:
+
+    double wall_;
+    double cpu_;
+
+};
+
+// the times for each stage of a single sentence
+class DecodeTimes {
+
+public:
+
+    DecodeTimes() : composeWall_(), composeCpu_() {
+        for(int i = 0; i < NUM_STAGES; i++)
+            wall_[i] = cpu_[i] = 0;
+    }
+
+    // add the time since the timer was last reset to a stage
+    void lap(DecodeStage stage, StageTimer & timer) {
+        double wall, cpu;
+        timer.lap(wall, cpu);
+        wall_[stage] += wall;
+        cpu_[stage] += cpu;
+    }
+    void lapCompose(unsigned model, StageTimer & timer) {
+        double wall, cpu;
+        timer.lap(wall, cpu);
+        if(composeWall_.size() <= model) {
+            composeWall_.resize(model+1, 0);
+            composeCpu_.resize(model+1, 0);
+        }
+        composeWall_[model] += wall;
+        composeCpu_[model] += cpu;
+    }
+
+    double getWall(DecodeStage stage) const { return wall_[stage]; }
+    double getCpu(DecodeStage stage) const { return cpu_[stage]; }
+    unsigned getNumModels() const { return composeWall_.size(); }
+    double getComposeWall(unsigned model) const { return composeWall_[model]; }
+    double getComposeCpu(unsigned model) const { return composeCpu_[model]; }
+
+private:
+
+    double wall_[NUM_STAGES];
+    double cpu_[NUM_STAGES];
+    std::vector<double> composeWall_;
+    std::vector<double> composeCpu_;
+
+};
+
+// a histogram of times with logarithmically spaced buckets, twenty per
+//  decade from 0.1 microseconds to 1000 seconds
+class LatencyHistogram {
+
+public:
+
+    LatencyHistogram() : counts_(NUM_BUCKETS, 0), count_(0) { }
+
+    void add(double seconds);
+
+    // get an approximation of the q-th quantile (0 <= q <= 1) in seconds
+    double getQuantile(double q) const;
+
+    unsigned long getCount() const { return count_; }
+
+private:
+
+    static const int BUCKETS_PER_DECADE = 20;
+    static const int NUM_BUCKETS = 10 * BUCKETS_PER_DECADE + 2;
+
+    std::vector<unsigned long> counts_;
+    unsigned long count_;
+
+};
+
+// total and per-sentence times for a single stage
+class StageStats {
+
+public:
+
+    StageStats() : wall_(0), cpu_(0), latency_() { }
+
+    void add(double wall, double cpu) {
+        wall_ += wall;
+        cpu_ += cpu;
+        latency_.add(wall);
+    }
+
+    unsigned long getCount() const { return latency_.getCount(); }
+    double getWall() const { return wall_; }
+    double getCpu() const { return cpu_; }
+    const LatencyHistogram & getLatency() const { return latency_; }
+
+private:
+
+    double wall_;
+    double cpu_;
+    LatencyHistogram latency_;
+
+};
+
+// statistics accumulated over all decoded sentences
+class DecodeStats {
+
+public:
+
+    DecodeStats() : compose_(), sentence_() { }
+
+    // add the times of a single sentence
+    void add(const DecodeTimes & times);
+
+    // write the statistics as a single JSON object
+    void writeJson(std::ostream & out) const;
+
+    // print a human-readable summary
+    void print(std::ostream & out) const;
+
+    static const char* getStageName(DecodeStage stage);
+
+private:
+
+    StageStats stages_[NUM_STAGES];
+    std::vector<StageStats> compose_;
+    // the total of all stages for each sentence
+    StageStats sentence_;
+
+};
+
+}
+
+#endif // KYFD_DECODE_STATS_H__
@@ -60,16 +60,25 @@ private:
     // number of pointers to this impl
     int count_;
 
-    // string buffer
-    string str_;
-
     // members
     fst::SymbolTable* iSymbols_;
     fst::SymbolTable* oSymbols_;
     unsigned n_;
     unsigned beamWidth_;
     float trimWidth_;
+    float beamThreshold_;
+    bool recombine_;
+    bool viterbi_;
+    bool recoverComponents_;
+    unsigned fallbackCache_;
     unsigned reload_;
+    unsigned threads_;
+    bool pipeline_;
+    unsigned queueSize_;
+    std::string serve_;
+    std::string stats_;
+    std::string searchStats_;
+    std::string cacheDir_;
     Weights weights_;
     InputFormat inFormat_;
     OutputFormat outFormat_;
@@ -98,6 +107,9 @@ private:
 
 };
 
+// The decoder configuration. All of the const accessors are safe to call
+//  from several threads at once, but copies share a reference count, so
+//  threads should share a single copy rather than making their own.
 class DecoderConfig
 {
 public:
@@ -117,9 +129,11 @@ public:
             delete impl_;
     }
     DecoderConfig & operator=(const DecoderConfig &conf) {
+        conf.impl_->count_++;
+        if(--impl_->count_ == 0)
+            delete impl_;
         impl_ = conf.impl_;
-        impl_->count_++;
-        
+        return *this;
     }
 
     // commands to parse input
@@ -138,13 +152,11 @@ public:
     int getOutputId(const string & str) const {
         return ( impl_->oSymbols_ ? impl_->oSymbols_->Find(str.c_str()) : -1 );
     }
-    const char * getInputSymbol(int id) const {
-        impl_->str_ = ( impl_->iSymbols_ ? impl_->iSymbols_->Find(id).c_str() : "" );
-        return impl_->str_.c_str();
+    std::string getInputSymbol(int id) const {
+        return ( impl_->iSymbols_ ? impl_->iSymbols_->Find(id) : std::string() );
     }
-    const char* getOutputSymbol(int id) const {
-        impl_->str_ = ( impl_->oSymbols_ ? impl_->oSymbols_->Find(id).c_str() : "" );
-        return impl_->str_.c_str();
+    std::string getOutputSymbol(int id) const {
+        return ( impl_->oSymbols_ ? impl_->oSymbols_->Find(id) : std::string() );
     }
 
     // accessors
@@ -152,6 +164,20 @@ public:
     void setN(unsigned n) { impl_->n_ = n; }
     unsigned getReload() const { return impl_->reload_; }
     void setReload(unsigned n) { impl_->reload_ = n; }
+    unsigned getThreads() const { return impl_->threads_; }
+    void setThreads(unsigned n) { impl_->threads_ = n; }
+    bool isPipeline() const { return impl_->pipeline_; }
+    void setPipeline(bool pipeline) { impl_->pipeline_ = pipeline; }
+    unsigned getQueueSize() const { return impl_->queueSize_; }
+    void setQueueSize(unsigned n) { impl_->queueSize_ = n; }
+    const std::string & getServe() const { return impl_->serve_; }
+    void setServe(const std::string & serve) { impl_->serve_ = serve; }
+    const std::string & getStats() const { return impl_->stats_; }
+    void setStats(const std::string & stats) { impl_->stats_ = stats; }
+    const std::string & getSearchStats() const { return impl_->searchStats_; }
+    void setSearchStats(const std::string & searchStats) { impl_->searchStats_ = searchStats; }
+    const std::string & getCacheDir() const { return impl_->cacheDir_; }
+    void setCacheDir(const std::string & cacheDir) { impl_->cacheDir_ = cacheDir; }
     bool isPrintDuplicates() const { return impl_->printDuplicates_; }
     void setPrintDuplicates(bool printDuplicates) { impl_->printDuplicates_ = printDuplicates; }
     bool isPrintInput() const { return impl_->printInput_; }
@@ -168,6 +194,16 @@ public:
     void setBeamWidth(unsigned beamWidth) { impl_->beamWidth_ = beamWidth; }
     float getTrimWidth() const { return impl_->trimWidth_; }
     void setTrimWidth(float trimWidth) { impl_->trimWidth_ = trimWidth; }
+    float getBeamThreshold() const { return impl_->beamThreshold_; }
+    void setBeamThreshold(float beamThreshold) { impl_->beamThreshold_ = beamThreshold; }
+    bool isRecombine() const { return impl_->recombine_; }
+    void setRecombine(bool recombine) { impl_->recombine_ = recombine; }
+    bool isViterbi() const { return impl_->viterbi_; }
+    void setViterbi(bool viterbi) { impl_->viterbi_ = viterbi; }
+    bool isRecoverComponents() const { return impl_->recoverComponents_; }
+    void setRecoverComponents(bool recoverComponents) { impl_->recoverComponents_ = recoverComponents; }
+    unsigned getFallbackCache() const { return impl_->fallbackCache_; }
+    void setFallbackCache(unsigned fallbackCache) { impl_->fallbackCache_ = fallbackCache; }
     
     // symbol functions
     const string & getUnknownSymbol() const { return impl_->unkSym_; }
@@ -192,27 +228,30 @@ public:
     int getOutputUnknownId() const { return impl_->oUnkId_; }
 
     // weight functions
-    Weights & getWeights() { return impl_->weights_; };
+    const Weights & getWeights() const { return impl_->weights_; };
     void setWeights(const Weights & weights);
     void loadWeights(const char* fileName);
 
     // file format options
-    OutputFormat getOutputFormat() { return impl_->outFormat_; }
+    OutputFormat getOutputFormat() const { return impl_->outFormat_; }
     void setOutputFormat(OutputFormat outFormat) { impl_->outFormat_ = outFormat; }
-    InputFormat getInputFormat() { return impl_->inFormat_; }
+    InputFormat getInputFormat() const { return impl_->inFormat_; }
     void setInputFormat(InputFormat inFormat) { impl_->inFormat_ = inFormat; }
 
     // model functions
-    int getNumModels() { 
+    int getNumModels() const { 
         return (impl_->compRoots_.size() > impl_->stdRoots_.size() ? impl_->compRoots_.size() : impl_->stdRoots_.size());
     }
-    const FstNode<fst::ComponentArc> * getComponentNode(unsigned id);
-    const FstNode<fst::StdArc> * getStdNode(unsigned id);
+    const FstNode<fst::ComponentArc> * getComponentNode(unsigned id) const;
+    const FstNode<fst::StdArc> * getStdNode(unsigned id) const;
 
 private:
     
     // handle a single argument
     void handleArgument(const char* name, const char* val);
+
+    // pass the weights on to the model nodes
+    void applyWeights();
     
     // the implementation
     DecoderConfigImpl* impl_;
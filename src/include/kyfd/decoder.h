@@ -23,14 +23,137 @@
 #include <vector>
 #include <string>
 #include <iostream>
-#include <ctime>
+#include <fstream>
 #include <fst/arc.h>
 #include <fst/vector-fst.h>
 #include <kyfd/component-arc.h>
 #include <kyfd/decoder-config.h>
+#include <kyfd/threads.h>
+#include <kyfd/decode-stats.h>
+#include <kyfd/search-stats.h>
 
 namespace kyfd {
 
+class Decoder;
+
+// A sentence that has been read and converted into an FST, ready to be
+//  searched. Only the FST matching the arcs used in search is used.
+class DecodeInput {
+
+public:
+
+    typedef std::vector<std::string> Strings;
+
+    DecodeInput() : id_(0), unknowns_(), compFst_(0), stdFst_(0) { }
+
+    ~DecodeInput() {
+        delete compFst_;
+        delete stdFst_;
+    }
+
+    int getId() const { return id_; }
+    void setId(int id) { id_ = id; }
+
+private:
+
+    friend class Decoder;
+
+    int id_;
+    // unknown words in the sentence
+    Strings unknowns_;
+    fst::Fst<fst::ComponentArc>* compFst_;
+    fst::Fst<fst::StdArc>* stdFst_;
+    DecodeTimes times_;
+
+    DecodeInput(const DecodeInput &);       // disallow
+    void operator=(const DecodeInput &);    // disallow
+
+};
+
+// The paths found for a sentence, ready to be printed
+class DecodeResult {
+
+public:
+
+    typedef std::vector<std::string> Strings;
+
+    DecodeResult() : id_(0), unknowns_(), compFst_(0), stdFst_(0), bothInput_(false) { }
+
+    ~DecodeResult() {
+        delete compFst_;
+        delete stdFst_;
+    }
+
+    int getId() const { return id_; }
+
+private:
+
+    friend class Decoder;
+
+    int id_;
+    Strings unknowns_;
+    fst::Fst<fst::ComponentArc>* compFst_;
+    fst::Fst<fst::StdArc>* stdFst_;
+    // no path was found, so the FST holds the input instead
+    bool bothInput_;
+    DecodeTimes times_;
+    // only filled in when search statistics are written
+    SearchStats searchStats_;
+
+    DecodeResult(const DecodeResult &);     // disallow
+    void operator=(const DecodeResult &);   // disallow
+
+};
+
+// The state that changes while decoding a single sentence. A Decoder may be
+//  shared between threads as long as each thread decodes with its own
+//  context.
+class DecodeContext {
+
+public:
+
+    typedef std::vector<std::string> Strings;
+
+    // make copies of the decoder's models that are safe to use in this context
+    //  the context must be reset whenever the decoder's models are rebuilt
+    DecodeContext(const Decoder & decoder);
+
+    ~DecodeContext() {
+        clearModels();
+    }
+
+    // re-copy the models from the decoder, flushing any lazily expanded states
+    void reset();
+
+    int getSentenceId() const { return sentenceId_; }
+    void setSentenceId(int sentenceId) { sentenceId_ = sentenceId; }
+
+private:
+
+    friend class Decoder;
+
+    void clearModels();
+
+    const Decoder & decoder_;
+
+    int sentenceId_;
+
+    // this context's views of the models, and private copies of any models
+    //  that are expanded lazily (and thus have a cache)
+    std::vector< fst::Fst<fst::ComponentArc>* > compModels_;
+    std::vector< fst::Fst<fst::ComponentArc>* > compCopies_;
+    std::vector< fst::Fst<fst::StdArc>* > stdModels_;
+    std::vector< fst::Fst<fst::StdArc>* > stdCopies_;
+
+    DecodeContext(const DecodeContext &);       // disallow
+    void operator=(const DecodeContext &);      // disallow
+
+};
+
+// The decoder, which holds the models. Once built, the models are only read
+//  while decoding, so any number of threads may decode with one decoder
+//  using the methods that take a context, as long as each thread uses its
+//  own context and buildModels() is not called at the same time.
 class Decoder {
 
 public:
@@ -40,66 +163,137 @@ public:
     Decoder(const DecoderConfig & config);
 
     ~Decoder() {
+        delete context_;
+        delete searchStatsFile_;
         for(int i = 0; i < stdModels_.size(); i++)
             delete stdModels_[i];
         for(int i = 0; i < compModels_.size(); i++)
             delete compModels_[i];
+        ClearFallbackCaches(compFallbackCaches_);
+        ClearFallbackCaches(stdFallbackCaches_);
+        ClearLabelIndexes(compIndexes_);
+        ClearLabelIndexes(stdIndexes_);
     }
 
     void buildModels();
 
-    bool decode(std::istream& in, std::ostream& out);
+    // decode a single sentence using the decoder's own context
+    bool decode(std::istream& in, std::ostream& out) {
+        return decode(*context_, in, out);
+    }
+
+    // decode the next sentence in the input stream with a context
+    bool decode(DecodeContext & ctx, std::istream& in, std::ostream& out) const;
+
+    // decode a sentence that has already been split into tokens
+    bool decode(DecodeContext & ctx, const Strings & tokens, std::ostream& out) const;
+
+    // decode a sentence that has already been read, taking ownership of it.
+    //  The input is deleted even if decoding throws, as it is by search()
+    bool decode(DecodeContext & ctx, DecodeInput * input, std::ostream& out) const;
+
+    // the stages of decoding, which may be run in separate threads. Only 
+    //  search() needs a context, the other two only read the configuration
+    DecodeInput * readInput(std::istream& in) const;
+    DecodeInput * readInput(const Strings & tokens) const;
+    DecodeResult * search(DecodeContext & ctx, DecodeInput * input) const;
+    void printResult(const DecodeResult & result, std::ostream& out) const;
+
+    // read the raw text of a single sentence (a line, or an FST block) 
+    //  without decoding it
+    bool readSentence(std::istream& in, std::string & sentence) const;
+
+    // split a string into tokens
+    static Strings splitTokens(const std::string & input);
+
+    const DecoderConfig & getConfig() const { return config_; }
 
-    void printTimes() {
-        double dub = CLOCKS_PER_SEC;
-        double sum = 0;
-        for(unsigned i = 0; i < timeSpent_.size(); i++)
-            sum += timeSpent_[i];
-        for(unsigned i = 0; i < timeSpent_.size(); i++)
-            cerr << "Stage " << (i+1) << ": " << (timeSpent_[i]/dub) << " sec (" << (timeSpent_[i]/sum*100) << "%)"<<endl;
+    // print the time spent in each stage for all sentences printed so far,
+    //  may be called while other threads are decoding
+    void printTimes(std::ostream & out) const {
+        ThreadLock lock(statsMutex_);
+        stats_.print(out);
+    }
+    void writeStats(std::ostream & out) const {
+        ThreadLock lock(statsMutex_);
+        stats_.writeJson(out);
     }
 
 private:
 
-    // process a single sentence
-    template <class A, class W, class LM>
-    bool process(const std::vector< fst::Fst<A> * > & models, 
+    friend class DecodeContext;
+
+    // search a single sentence, taking ownership of the input and returning
+    //  the FST to print
+    template <class A, class LM>
+    fst::Fst<A> * process(DecodeContext & ctx,
+                    const std::vector< fst::Fst<A> * > & models, 
                     const std::vector< const LM* > & fallbacks,
-                    std::istream & in, std::ostream & out);
+                    const std::vector< fst::FallbackCache<A>* > & caches,
+                    const std::vector< fst::LabelIndex<A>* > & indexes,
+                    fst::Fst<A> * input, bool & bothInput,
+                    DecodeTimes & times, SearchStats * searchStats) const;
 
     // print out the paths
     template <class A, class W>
     void printPaths(
+        const Strings & unknowns,
         const fst::Fst<A> &bestFst, 
         const std::string &header,
         std::ostream & resultStream,
-        bool bothInput);
+        bool bothInput) const;
+
+    // compose an FST with each of the models in order, taking ownership of
+    //  the FST. Times and statistics are only recorded if given
+    template <class A, class LM>
+    fst::Fst<A> * composeModels(fst::Fst<A> * searchFst,
+                                const std::vector< fst::Fst<A> * > & models,
+                                const std::vector< const LM* > & fallbacks,
+                                const std::vector< fst::FallbackCache<A>* > & caches,
+                                const std::vector< fst::LabelIndex<A>* > & indexes,
+                                bool allowStatic,
+                                DecodeTimes * times,
+                                SearchStats * searchStats) const;
+
+    // find the component weights of the paths found by a search over
+    //  standard arcs, using the best path through the component models with
+    //  the same output as each. paths that have none are kept with only their
+    //  standard score
+    fst::Fst<fst::ComponentArc> * recoverComponents(DecodeContext & ctx,
+                                const fst::Fst<fst::ComponentArc> & input,
+                                const fst::Fst<fst::StdArc> & bestFst) const;
+
+    // whether the search is done over standard arcs, which is the case
+    //  unless components are output without being recovered after search
+    bool isStdSearch() const {
+        return config_.getOutputFormat() != COMPONENT_OUTPUT || config_.isRecoverComponents();
+    }
 
     // compose and get the best paths
     template <class A, class LM>
-    fst::Fst<A> * findBestPaths(const fst::Fst<A> * input, 
+    fst::Fst<A> * findBestPaths(DecodeContext & ctx,
+                                const fst::Fst<A> * input, 
                                 const std::vector< fst::Fst<A> * > & models,
-                                const std::vector< const LM* > & fallbacks
-                                 );
+                                const std::vector< const LM* > & fallbacks,
+                                const std::vector< fst::FallbackCache<A>* > & caches,
+                                const std::vector< fst::LabelIndex<A>* > & indexes,
+                                DecodeTimes & times,
+                                SearchStats * searchStats
+                                 ) const;
 
     // make the input fst with a template for arcs
     template <class A> 
-    fst::VectorFst<A> * makeFst(std::istream & arr);
+    fst::VectorFst<A> * makeFst(Strings & unknowns, std::istream & arr) const;
     template <class A> 
-    fst::VectorFst<A> * makeFst(const Strings & arr);
+    fst::VectorFst<A> * makeFst(Strings & unknowns, const Strings & arr) const;
     template <class W>
-    W parseWeight(const std::string & str);
-
-    // split a string into tokens
-    Strings splitTokens(const std::string & input);
+    W parseWeight(const std::string & str) const;
 
-    const std::string & getWeightString(const fst::TropicalWeight & weight);
-    const std::string & getWeightString(const fst::ComponentWeight & weight);
+    std::string getWeightString(const fst::TropicalWeight & weight) const;
+    std::string getWeightString(const fst::ComponentWeight & weight) const;
 
     // members
     DecoderConfig config_;
-    Strings unknowns_;
-    int sentenceId_;
 
     // two possible models based
     std::vector< fst::Fst<fst::ComponentArc>* > compModels_;
@@ -111,27 +305,60 @@ private:
     typedef fst::FallbackMatcher<fst::Matcher<fst::Fst<fst::StdArc> > >::LabelMap StdLabelMap;
     std::vector< const StdLabelMap* >     stdFallbacks_;
 
-    // a string buffer
-    std::string str_;
+    // the fallbacks followed in each model, shared by all contexts, or NULL
+    //  for models that are not cached
+    std::vector< fst::FallbackCache<fst::ComponentArc>* > compFallbackCaches_;
+    std::vector< fst::FallbackCache<fst::StdArc>* > stdFallbackCaches_;
+
+    // make the fallback cache for a model if one is wanted
+    template <class A, class LM>
+    fst::FallbackCache<A> * makeFallbackCache(const fst::Fst<A> & model, const LM * fallbacks) const;
+    template <class A>
+    static void ClearFallbackCaches(std::vector< fst::FallbackCache<A>* > & caches) {
+        for(unsigned i = 0; i < caches.size(); i++)
+            delete caches[i];
+        caches.clear();
+    }
+
+    // the label indexes of the states with many arcs in each model, shared
+    //  by all contexts, or NULL for models that are not indexed
+    std::vector< fst::LabelIndex<fst::ComponentArc>* > compIndexes_;
+    std::vector< fst::LabelIndex<fst::StdArc>* > stdIndexes_;
+
+    template <class A>
+    static void ClearLabelIndexes(std::vector< fst::LabelIndex<A>* > & indexes) {
+        for(unsigned i = 0; i < indexes.size(); i++)
+            delete indexes[i];
+        indexes.clear();
+    }
+
     int multiplier_;
 
-    // debugging values to keep track of how much time is spent doing what
-    unsigned timeStep_;
-    std::vector<clock_t> timeSpent_;
-    std::vector<clock_t> currTime_;
+    // protects the reference counts of the models while contexts copy them
+    mutable ThreadMutex modelMutex_;
+
+    // timing statistics for all sentences, added to when results are printed
+    mutable ThreadMutex statsMutex_;
+    mutable DecodeStats stats_;
+    // where to write the search statistics for each sentence, if anywhere,
+    //  also protected by statsMutex_
+    std::ofstream * searchStatsFile_;
+
+    // the context used when none is specified
+    DecodeContext * context_;
 
 };
 
 // TODO make these work with component weights as well
 template<> inline
-fst::ComponentWeight Decoder::parseWeight(const string & str) {
+fst::ComponentWeight Decoder::parseWeight(const string & str) const {
     float weight = atof(str.c_str());
     float comp[2] = { weight * config_.getWeights()[0], weight };
     return fst::ComponentWeight(2, comp); 
 }
 
 template<> inline
-fst::TropicalWeight Decoder::parseWeight(const string & str) {
+fst::TropicalWeight Decoder::parseWeight(const string & str) const {
     return fst::TropicalWeight(atof(str.c_str()));
 }
 
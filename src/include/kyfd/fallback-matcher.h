@@ -25,11 +25,254 @@
 #include <algorithm>
 
 #include <map>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
 #include <fst/fst.h>
 #include <fst/matcher.h>
+#include <kyfd/threads.h>
 
 namespace fst {
 
+// counts of the work done by the matchers of a single composition, to find
+//  out which model is slow
+struct FallbackMatcherCounts {
+    FallbackMatcherCounts() : states(0), arcs(0), fallbacks(0), cacheHits(0), cacheMisses(0) { }
+    uint64 states;      // states expanded
+    uint64 arcs;        // arcs matched
+    uint64 fallbacks;   // fallback transitions followed
+    uint64 cacheHits;   // fallbacks found in the FallbackCache
+    uint64 cacheMisses; // fallbacks not found in the FallbackCache
+};
+
+// The labels to fall back to for every label, worked out once when the
+//  fallbacks are loaded. The whole chain of labels to try after each label
+//  is stored in one array, so the matcher can walk it without looking up
+//  each label in turn. A chain ends at a label that has no fallback, falls
+//  back to itself or to kNoLabel, or that has already been tried.
+//
+// Fallbacks are given in a text file with a label and the label that it
+//  falls back to on each line. Tables can also be written in a binary
+//  format holding the chains themselves, which is read with no parsing.
+//  The binary format uses the byte order of the machine that wrote it, so
+//  it should be converted again on machines with a different byte order.
+template <class L>
+class FallbackTable {
+
+public:
+
+    typedef L Label;
+
+    FallbackTable() : offsets_(1, 0) { }
+
+    explicit FallbackTable(const std::map<L, L> & fallbacks) : offsets_(1, 0) {
+        // negative labels never have fallbacks
+        Label maxLabel = (fallbacks.size() ? std::max(fallbacks.rbegin()->first, (Label)-1) : -1);
+        offsets_.reserve(maxLabel + 2);
+        for(Label label = 0; label <= maxLabel; label++) {
+            size_t start = chains_.size();
+            Label curr = label;
+            while(1) {
+                typename std::map<L, L>::const_iterator it = fallbacks.find(curr);
+                if(it == fallbacks.end() || it->second == curr || it->second == kNoLabel
+                   || it->second == label
+                   || std::find(chains_.begin() + start, chains_.end(), it->second) != chains_.end())
+                    break;
+                curr = it->second;
+                chains_.push_back(curr);
+            }
+            offsets_.push_back(chains_.size());
+        }
+    }
+
+    // the labels to try in order when a label is not found
+    const Label * Begin(Label label) const {
+        return (label >= 0 && (size_t)label < NumLabels() ? Chains() + offsets_[label] : Chains());
+    }
+    const Label * End(Label label) const {
+        return (label >= 0 && (size_t)label < NumLabels() ? Chains() + offsets_[label+1] : Chains());
+    }
+
+    // the number of labels that may have fallbacks
+    size_t NumLabels() const { return offsets_.size() - 1; }
+
+    // read the label pairs of a text file
+    static void ReadText(const std::string & fileName, std::map<L, L> & fallbacks) {
+        std::ifstream in(fileName.c_str());
+        if(!in)
+            throw std::runtime_error("Fallback map file '"+fileName+"' could not be found.");
+        std::string line;
+        for(int lineNum = 1; std::getline(in, line); lineNum++) {
+            std::istringstream iss(line);
+            Label label, fallback;
+            std::string rest;
+            if(!(iss >> label)) {
+                if(line.find_first_not_of(" \t\r") == std::string::npos)
+                    continue;
+            } else if(label >= 0 && iss >> fallback && !(iss >> rest)
+                      && (fallback >= 0 || fallback == kNoLabel)) {
+                fallbacks[label] = fallback;
+                continue;
+            }
+            std::ostringstream buff;
+            buff << "Bad line " << lineNum << " in fallback map file '" << fileName << "': " << line;
+            throw std::runtime_error(buff.str());
+        }
+    }
+
+    // read a table in either format, returning a new table
+    static FallbackTable<L> * Read(const std::string & fileName) {
+        std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+        if(!in)
+            throw std::runtime_error("Fallback map file '"+fileName+"' could not be found.");
+        int32 magic = 0;
+        if(!in.read((char*)&magic, sizeof(magic)) || magic != kMagic) {
+            std::map<L, L> fallbacks;
+            ReadText(fileName, fallbacks);
+            return new FallbackTable<L>(fallbacks);
+        }
+        // the header is followed by the offsets and the chains, as they are
+        //  kept in memory
+        int32 labelSize;
+        uint64 numLabels, numChains;
+        in.read((char*)&labelSize, sizeof(labelSize));
+        in.read((char*)&numLabels, sizeof(numLabels));
+        in.read((char*)&numChains, sizeof(numChains));
+        if(!in || labelSize != sizeof(Label))
+            throw std::runtime_error("Bad header in binary fallback map file '"+fileName+"'");
+        // check the sizes against the rest of the file before allocating
+        //  anything, so a corrupt header cannot ask for too much memory
+        std::streampos dataStart = in.tellg();
+        in.seekg(0, std::ios::end);
+        uint64 dataSize = in.tellg() - dataStart;
+        in.seekg(dataStart);
+        if(numLabels >= dataSize / sizeof(uint32) || numChains > dataSize / sizeof(Label)
+           || (numLabels + 1) * sizeof(uint32) + numChains * sizeof(Label) != dataSize)
+            throw std::runtime_error("Binary fallback map file '"+fileName+"' does not match the size in its header");
+        FallbackTable<L> * ret = new FallbackTable<L>;
+        ret->offsets_.resize(numLabels + 1);
+        ret->chains_.resize(numChains);
+        in.read((char*)&ret->offsets_[0], ret->offsets_.size() * sizeof(uint32));
+        if(numChains)
+            in.read((char*)&ret->chains_[0], numChains * sizeof(Label));
+        if(!in || ret->offsets_[0] != 0 || ret->offsets_.back() != numChains) {
+            delete ret;
+            throw std::runtime_error("Binary fallback map file '"+fileName+"' is truncated");
+        }
+        for(size_t i = 0; i < numLabels; i++) {
+            if(ret->offsets_[i] > ret->offsets_[i+1]) {
+                delete ret;
+                throw std::runtime_error("Bad offsets in binary fallback map file '"+fileName+"'");
+            }
+        }
+        return ret;
+    }
+
+    // write the table in the binary format
+    bool Write(const std::string & fileName) const {
+        std::ofstream out(fileName.c_str(), std::ios::out | std::ios::binary);
+        int32 magic = kMagic, labelSize = sizeof(Label);
+        uint64 numLabels = NumLabels(), numChains = chains_.size();
+        out.write((const char*)&magic, sizeof(magic));
+        out.write((const char*)&labelSize, sizeof(labelSize));
+        out.write((const char*)&numLabels, sizeof(numLabels));
+        out.write((const char*)&numChains, sizeof(numChains));
+        out.write((const char*)&offsets_[0], offsets_.size() * sizeof(uint32));
+        if(numChains)
+            out.write((const char*)&chains_[0], numChains * sizeof(Label));
+        return out.good();
+    }
+
+private:
+
+    // the first bytes of a binary file, which cannot start a text file
+    static const int32 kMagic = 0x7f6b4642;
+
+    const Label * Chains() const { return chains_.size() ? &chains_[0] : 0; }
+
+    // the chain of each label starts at its offset and ends at the next
+    std::vector<uint32> offsets_;
+    std::vector<Label> chains_;
+
+};
+
+template <class L>
+const int32 FallbackTable<L>::kMagic;
+
+// The results of following the fallbacks of labels that are not found at
+//  a state, shared by all of the matchers of a model so that the same
+//  state and label are only resolved once. State ids must mean the same in
+//  every copy of the model, so this is only used with expanded models. Each
+//  state and label has a single slot in a table of fixed size, and a new
+//  result replaces whatever was in its slot. The slots are protected by a
+//  number of locks, so threads rarely wait for each other.
+template <class A>
+class FallbackCache {
+
+public:
+
+    typedef typename A::StateId StateId;
+    typedef typename A::Label Label;
+    typedef typename A::Weight Weight;
+
+    struct Entry {
+        StateId state;      // the state where the label was not found
+        Label label;        // the label that was not found
+        StateId dest;       // the state where a match was found
+        Label found;        // the label matched there, kNoLabel on failure
+        Label matchIn;      // the labels to rewrite the matched arcs with
+        Label matchOut;
+        Weight weight;      // the weight of the fallback arcs followed
+    };
+
+    // the size is rounded up to a power of two
+    FallbackCache(size_t size) {
+        size_t slots = 1;
+        while(slots < size)
+            slots *= 2;
+        Entry empty;
+        empty.state = kNoStateId;
+        empty.label = kNoLabel;
+        entries_.resize(slots, empty);
+        mask_ = slots - 1;
+    }
+
+    // copy the entry for a state and label, returning false if there is none
+    bool Lookup(StateId state, Label label, Entry * entry) {
+        size_t slot = Slot(state, label);
+        kyfd::ThreadLock lock(locks_[slot % kNumLocks]);
+        const Entry & stored = entries_[slot];
+        if(stored.state != state || stored.label != label)
+            return false;
+        *entry = stored;
+        return true;
+    }
+
+    void Store(const Entry & entry) {
+        size_t slot = Slot(entry.state, entry.label);
+        kyfd::ThreadLock lock(locks_[slot % kNumLocks]);
+        entries_[slot] = entry;
+    }
+
+private:
+
+    static const int kNumLocks = 64;
+
+    size_t Slot(StateId state, Label label) const {
+        return ((size_t)state * 7853 + (size_t)label * 2654435761u) & mask_;
+    }
+
+    std::vector<Entry> entries_;
+    size_t mask_;
+    kyfd::ThreadMutex locks_[kNumLocks];
+
+    FallbackCache(const FallbackCache<A> &);     // disallow
+    void operator=(const FallbackCache<A> &);    // disallow
+
+};
+
 // A heirarchical failure transition model that allows multiple levels of
 //  fallback for phi-transitions
 template <class M>
@@ -40,7 +283,8 @@ class FallbackMatcher: public MatcherBase<class M::Arc> {
     typedef typename Arc::StateId StateId;
     typedef typename Arc::Label Label;
     typedef typename Arc::Weight Weight;
-    typedef typename std::map<Label,Label> LabelMap;
+    typedef FallbackTable<Label> LabelMap;
+    typedef FallbackCache<Arc> Cache;
 
     FallbackMatcher(const FST &fst,
                          MatchType match_type,
@@ -53,22 +297,26 @@ class FallbackMatcher: public MatcherBase<class M::Arc> {
                 fallbacks_(fallbacks),
                 state_(kNoStateId),
                 rewrite_both_(rewrite_both ? true : fst.Properties(kAcceptor, true)),
-                phi_loop_(phi_loop) {
+                phi_loop_(phi_loop),
+                counts_(0),
+                cache_(0) {
         if (match_type == MATCH_BOTH)
             LOG(FATAL) << "FallbackMatcher: bad match type";
         // TODO: check compatibility with the symbol set
      }
 
-    FallbackMatcher(const FallbackMatcher<M> &matcher)
-            : matcher_(new M(*matcher.matcher_)),
+    FallbackMatcher(const FallbackMatcher<M> &matcher, bool safe = false)
+            : matcher_(new M(*matcher.matcher_, safe)),
                 match_type_(matcher.match_type_),
                 fallbacks_(matcher.fallbacks_),
                 rewrite_both_(matcher.rewrite_both_),
                 state_(kNoStateId),
-                phi_loop_(matcher.phi_loop_) {}
+                phi_loop_(matcher.phi_loop_),
+                counts_(matcher.counts_),
+                cache_(matcher.cache_) {}
 
     FallbackMatcher *Copy(bool safe = false) const {
-        return new FallbackMatcher(*this);
+        return new FallbackMatcher(*this, safe);
     }
 
 
@@ -85,7 +333,17 @@ class FallbackMatcher: public MatcherBase<class M::Arc> {
 
     MatchType Type(bool test) const { return matcher_->Type(test); }
 
+    // count the work done in counts, which must outlive the matcher and any
+    //  copies of it
+    void SetCounts(FallbackMatcherCounts * counts) { counts_ = counts; }
+
+    // remember the results of following fallbacks in cache, which must
+    //  outlive the matcher and any copies of it
+    void SetCache(Cache * cache) { cache_ = cache; }
+
     void SetState(StateId s) {
+        if (counts_)
+            counts_->states++;
         matcher_->SetState(s);
         state_ = s;
         // has_phi_ = phi_label_ != kNoLabel;
@@ -102,39 +360,34 @@ class FallbackMatcher: public MatcherBase<class M::Arc> {
         phi_weight_ = Weight::One();
         if (!fallbacks_ || match_label == 0 || match_label == kNoLabel)
             return matcher_->Find(match_label);
-        StateId state = state_;
-        while (!matcher_->Find(match_label)) {
-            Label curr_label = match_label;
-            while(1) {
-                typename LabelMap::const_iterator labelit = fallbacks_->find(curr_label);
-                if(labelit == fallbacks_->end() 
-                    || curr_label == (*labelit).second 
-                    || kNoLabel == (*labelit).second)
+        if (matcher_->Find(match_label))
+            return true;
+        typename Cache::Entry entry;
+        if (cache_) {
+            if (cache_->Lookup(state_, match_label, &entry)) {
+                if (counts_)
+                    counts_->cacheHits++;
+                if (entry.found == kNoLabel)
                     return false;
-                curr_label = (*labelit).second;
-                if(matcher_->Find(curr_label))
-                    break;
-            }
-            phi_arc_ = matcher_->Value();
-            if (phi_loop_ && phi_arc_.nextstate == state) {
-                // save the things to be deleted
-                if (rewrite_both_) {
-                    if (phi_arc_.ilabel == curr_label)
-                        phi_match_in_ = match_label;
-                    if (phi_arc_.olabel == curr_label)
-                        phi_match_out_ = match_label;
-                } else if (match_type_ == MATCH_INPUT) {
-                    phi_match_in_ = match_label;
-                } else {
-                    phi_match_out_ = match_label;
-                }
-                return true;
+                phi_match_in_ = entry.matchIn;
+                phi_match_out_ = entry.matchOut;
+                phi_weight_ = entry.weight;
+                matcher_->SetState(entry.dest);
+                return matcher_->Find(entry.found);
             }
-            phi_weight_ = Times(phi_weight_, matcher_->Value().weight);
-            state = matcher_->Value().nextstate;
-            matcher_->SetState(state);
+            if (counts_)
+                counts_->cacheMisses++;
         }
-        return true;
+        bool ret = FollowFallbacks(match_label, &entry.dest, &entry.found);
+        if (cache_) {
+            entry.state = state_;
+            entry.label = match_label;
+            entry.matchIn = phi_match_in_;
+            entry.matchOut = phi_match_out_;
+            entry.weight = phi_weight_;
+            cache_->Store(entry);
+        }
+        return ret;
     }
 
     bool Done() const { return matcher_->Done(); }
@@ -153,7 +406,11 @@ class FallbackMatcher: public MatcherBase<class M::Arc> {
         }
     }
 
-    void Next() { matcher_->Next(); }
+    void Next() {
+        if (counts_)
+            counts_->arcs++;
+        matcher_->Next();
+    }
 
 
     uint64 Properties(uint64 props) const {
@@ -165,9 +422,56 @@ class FallbackMatcher: public MatcherBase<class M::Arc> {
     virtual uint32 Flags() const { return 0; }
 
 private:
+    // follow the fallbacks of a label that was not found at the current
+    //  state, leaving the matcher at the matching arcs. The state and label
+    //  where they were found are written to dest and found
+    bool FollowFallbacks(Label match_label, StateId * dest, Label * found) {
+        StateId state = state_;
+        const Label * chainBegin = fallbacks_->Begin(match_label);
+        const Label * chainEnd = fallbacks_->End(match_label);
+        do {
+            Label curr_label = kNoLabel;
+            for(const Label * chain = chainBegin; ; chain++) {
+                if(chain == chainEnd) {
+                    *dest = state;
+                    *found = kNoLabel;
+                    return false;
+                }
+                curr_label = *chain;
+                if (counts_)
+                    counts_->fallbacks++;
+                if(matcher_->Find(curr_label))
+                    break;
+            }
+            phi_arc_ = matcher_->Value();
+            if (phi_loop_ && phi_arc_.nextstate == state) {
+                // save the things to be deleted
+                if (rewrite_both_) {
+                    if (phi_arc_.ilabel == curr_label)
+                        phi_match_in_ = match_label;
+                    if (phi_arc_.olabel == curr_label)
+                        phi_match_out_ = match_label;
+                } else if (match_type_ == MATCH_INPUT) {
+                    phi_match_in_ = match_label;
+                } else {
+                    phi_match_out_ = match_label;
+                }
+                *dest = state;
+                *found = curr_label;
+                return true;
+            }
+            phi_weight_ = Times(phi_weight_, matcher_->Value().weight);
+            state = matcher_->Value().nextstate;
+            matcher_->SetState(state);
+        } while (!matcher_->Find(match_label));
+        *dest = state;
+        *found = match_label;
+        return true;
+    }
+
     M *matcher_;
     MatchType match_type_;          // Type of match requested
-    const LabelMap *fallbacks_;     // A map holding information about which label to fallback to on failure
+    const LabelMap *fallbacks_;     // A table holding the labels to fall back to on failure
     bool rewrite_both_;             // Rewrite both sides when both are 'phi_label_'
     Label phi_label_;               // Label that represents the phi transition
     Label phi_match_in_;            // A label that should replace a phi-matched arc's input
@@ -177,6 +481,8 @@ private:
     Weight phi_weight_;             // Product of the weights of phi transitions taken
     bool phi_loop_;                 // When true, phi self-loop are allowed and treated
                                                     // as rho (required for Aho-Corasick)
+    FallbackMatcherCounts *counts_; // Where to count the work done, if anywhere
+    Cache *cache_;                  // Where to remember fallbacks, if anywhere
 
     void operator=(const FallbackMatcher<M> &);    // disallow
 };
@@ -0,0 +1,99 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// fd-stream.h
+//
+//  A buffered stream buffer over a file descriptor, so that sockets can be
+//   read and written with standard streams
+
+#ifndef KYFD_FD_STREAM_H__
+#define KYFD_FD_STREAM_H__
+
+#include <streambuf>
+#include <cerrno>
+#include <unistd.h>
+
+namespace kyfd {
+
+class FdStreamBuf : public std::streambuf {
+
+public:
+
+    // does not take ownership of the descriptor
+    FdStreamBuf(int fd) : fd_(fd) {
+        setg(inBuf_, inBuf_, inBuf_);
+        setp(outBuf_, outBuf_ + BUFFER_SIZE);
+    }
+
+    ~FdStreamBuf() { sync(); }
+
+protected:
+
+    int_type underflow() {
+        if(gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        ssize_t n;
+        do {
+            n = ::read(fd_, inBuf_, BUFFER_SIZE);
+        } while(n < 0 && errno == EINTR);
+        if(n <= 0)
+            return traits_type::eof();
+        setg(inBuf_, inBuf_, inBuf_ + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int_type overflow(int_type c) {
+        if(flushOutput() < 0)
+            return traits_type::eof();
+        if(!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() { return flushOutput(); }
+
+private:
+
+    int flushOutput() {
+        char * ptr = pbase();
+        while(ptr < pptr()) {
+            ssize_t n = ::write(fd_, ptr, pptr() - ptr);
+            if(n < 0) {
+                if(errno == EINTR)
+                    continue;
+                return -1;
+            }
+            ptr += n;
+        }
+        setp(outBuf_, outBuf_ + BUFFER_SIZE);
+        return 0;
+    }
+
+    static const int BUFFER_SIZE = 4096;
+
+    int fd_;
+    char inBuf_[BUFFER_SIZE];
+    char outBuf_[BUFFER_SIZE];
+
+    FdStreamBuf(const FdStreamBuf &);       // disallow
+    void operator=(const FdStreamBuf &);    // disallow
+
+};
+
+}
+
+#endif // KYFD_FD_STREAM_H__
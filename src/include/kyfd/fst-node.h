@@ -24,7 +24,13 @@
 #include <list>
 #include <iterator>
 #include <stdexcept>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <fst/vector-fst.h>
+#include <fst/const-fst.h>
 #include <fst/compose.h>
 #include <fst/encode.h>
 #include <fst/intersect.h>
@@ -33,8 +39,13 @@
 #include <fst/project.h>
 #include <fst/arcsort.h>
 #include <kyfd/fallback-matcher.h>
+#include <kyfd/indexed-matcher.h>
 #include <kyfd/component-arc.h>
 #include <kyfd/component-map.h>
+#include <kyfd/mapped-fst.h>
+#include <kyfd/interned-fst.h>
+#include <kyfd/util.h>
+#include <kyfd/threads.h>
 
 namespace kyfd {
 
@@ -64,6 +75,7 @@ private:
     int id_;
     float weight_;
     LabelMap * fbMap_;
+    size_t indexArcs_;
 
     FstNode<A>* leftChild_;
     FstNode<A>* rightChild_;
@@ -71,7 +83,7 @@ private:
 public:
 
     // ctor
-    FstNode() : id_(-1), properties_(0), operation_(PLAIN), method_(STATIC), weight_(1.0), leftChild_(0), rightChild_(0), fbMap_(0) { };
+    FstNode() : id_(-1), properties_(0), operation_(PLAIN), method_(STATIC), weight_(1.0), leftChild_(0), rightChild_(0), fbMap_(0), indexArcs_(0) { };
    
     // dtor 
     ~FstNode() {
@@ -95,10 +107,19 @@ public:
     int getId() const { return id_; }
     void setId(int id) { id_ = id; }
     const LabelMap * getFallbackMap() const { return fbMap_; }
-    void setFallbackMap(const LabelMap & fbMap) { 
+    // the fallback chains of every label are worked out here, once
+    void setFallbackMap(const std::map<typename A::Label, typename A::Label> & fbMap) { 
+        setFallbackMap(new LabelMap(fbMap));
+    }
+    // take ownership of a table that has already been built
+    void setFallbackMap(LabelMap * fbMap) { 
         if(fbMap_) delete fbMap_;
-        fbMap_ = new LabelMap(fbMap);
+        fbMap_ = fbMap;
     }
+    // the number of arcs above which the states of this node's FST are
+    //  indexed by label when it is matched, or zero to never index them
+    size_t getIndexArcs() const { return indexArcs_; }
+    void setIndexArcs(size_t indexArcs) { indexArcs_ = indexArcs; }
     FstNode<A>* getRight() { return rightChild_; }
     FstNode<A>* getLeft() { return leftChild_; }
 
@@ -112,41 +133,148 @@ public:
     }
 
     /**
-     * load an FST from a file and convert it to the proper format
+     * load an FST from a file and convert it to the proper format. Files in
+     *  the const format are memory-mapped and converted as they are read,
+     *  other files are read into memory. Standard models are converted into
+     *  a VectorFst, while component models are converted into an
+     *  InternedComponentFst
      */
     fst::Fst<A> * loadFst() const;
 
     /**
-     * A function to build an FST
+     * take an FST built by a static operation and convert it to the form
+     *  that is kept in memory, deleting the original if it is converted
+     */
+    fst::Fst<A> * storeFst(fst::VectorFst<A> * fst) const;
+
+    /**
+     * index the states of an FST with at least a number of arcs by label,
+     *  returning NULL if the number is zero or the FST cannot be indexed.
+     *  Only expanded FSTs sorted by input label can be indexed, and a
+     *  warning is printed with the name of the FST for others
+     */
+    static fst::LabelIndex<A> * makeLabelIndex(const fst::Fst<A> & fst, size_t indexArcs, const string & name) {
+        if(indexArcs == 0)
+            return 0;
+        if(!fst.Properties(fst::kExpanded, false) || !fst.Properties(fst::kILabelSorted, true)) {
+            cerr << "WARNING, not indexing fst " << name << " as it is not expanded and sorted by input label" << endl;
+            return 0;
+        }
+        return new fst::LabelIndex<A>(fst, indexArcs);
+    }
+
+    /**
+     * load a cached FST, returning NULL if it does not exist
+     */
+    fst::Fst<A> * loadCachedFst(const string & path) const;
+
+    /**
+     * save an FST to the cache
+     */
+    void saveCachedFst(const string & path, const fst::Fst<A> & fst) const;
+
+    /**
+     * get a description of everything that affects the FST built by this 
+     *  node, including the size and modification time of its files
+     */
+    void getCacheKey(std::ostream & out) const {
+        out << "(" << operation_ << " " << method_ << " " << properties_ << " "
+            << id_ << " " << std::setprecision(9) << weight_;
+        if(operation_ == PLAIN) {
+            struct stat st;
+            if(stat(file_.c_str(), &st) == 0)
+                out << " " << file_ << " " << st.st_size << " " << st.st_mtime;
+            else
+                out << " " << file_;
+        }
+        if(fbMap_) {
+            out << " fallback";
+            for(size_t label = 0; label < fbMap_->NumLabels(); label++)
+                if(fbMap_->Begin(label) != fbMap_->End(label))
+                    out << " " << label << ":" << *fbMap_->Begin(label);
+        }
+        if(leftChild_) leftChild_->getCacheKey(out);
+        if(rightChild_) rightChild_->getCacheKey(out);
+        out << ")";
+    }
+
+    /**
+     * get the file in the cache directory that holds this node's FST
+     */
+    string getCachePath(const string & cacheDir) const {
+        std::ostringstream key, path;
+        key << A::Type();
+        getCacheKey(key);
+        path << cacheDir << "/" << std::hex << std::setw(16) << std::setfill('0') 
+             << kyfd::hashString(key.str()) << ".fst";
+        return path.str();
+    }
+
+    /**
+     * build the FSTs of two nodes, building the second in another thread if
+     *  the budget allows it
+     */
+    static void buildPair(const FstNode<A> & left, const FstNode<A> & right,
+                          const string & cacheDir, ThreadBudget * budget,
+                          fst::Fst<A> * & leftFst, fst::Fst<A> * & rightFst);
+
+    /**
+     * A function to build an FST. If a cache directory is given, the results
+     *  of static operations are saved there and loaded when nothing that
+     *  they were built from has changed. If a budget is given, independent
+     *  subtrees are built in parallel using the threads that it allows.
      */
-    fst::Fst<A> * buildFst() const {
+    fst::Fst<A> * buildFst(const string & cacheDir = string(), ThreadBudget * budget = 0) const {
     
         fst::Fst<A> * ret;
         fst::VectorFst<A> * vecRet;
-        typedef fst::FallbackMatcher< fst::Matcher<fst::Fst<A> > > FB;
+        typedef fst::IndexedMatcher< fst::Fst<A> > IM;
+        typedef fst::FallbackMatcher<IM> FB;
         typedef fst::CacheOptions CacheOptions;
     
         // for plain FSTs
         if(operation_ == PLAIN) {
-            cerr << "Loading fst " << name_ << "... " << endl;
+            PrintProgress("Loading fst " + name_ + "... ");
             return loadFst();
         }
+        // check the cache
+        string cachePath;
+        if(method_ == STATIC && cacheDir.length() > 0) {
+            cachePath = getCachePath(cacheDir);
+            ret = loadCachedFst(cachePath);
+            if(ret) {
+                PrintProgress("Loaded fst " + name_ + " from cache " + cachePath);
+                return ret;
+            }
+        }
         // for multiple operations
+        std::ostringstream progress;
         if (operation_ == COMPOSE || operation_ == INTERSECT) {
             assert(leftChild_ && rightChild_);
-            fst::Fst<A> * leftFst = leftChild_->buildFst();
-            fst::Fst<A> * rightFst = rightChild_->buildFst();
-            cerr << ( operation_ == COMPOSE ? "Composing" : "Intersecting" ) 
+            fst::Fst<A> * leftFst, * rightFst;
+            buildPair(*leftChild_, *rightChild_, cacheDir, budget, leftFst, rightFst);
+            progress << ( operation_ == COMPOSE ? "Composing" : "Intersecting" ) 
                  << " fsts " << leftChild_->getName() << " and " << rightChild_->getName() << " "
                  << (method_ == STATIC ? "statically" : "dynamically" ) << "... ";
+            PrintProgress(progress.str());
             if(method_ == STATIC) {
                 fst::VectorFst<A> * vecRet = NULL;
                 if(operation_ == COMPOSE) {
-                    fst::ComposeFstOptions<A, FB> copts(CacheOptions(),
-                                  new FB(*leftFst,  ( rightChild_->getFallbackMap() == 0 ? fst::MATCH_OUTPUT : fst::MATCH_NONE ) ),
-                                  new FB(*rightFst, fst::MATCH_INPUT, rightChild_->getFallbackMap()));
-                    fst::ComposeFst<A> compFst(*leftFst, *rightFst, copts);
-                    vecRet = new fst::VectorFst<A>(compFst);
+                    // the index is only used while the composition is
+                    //  expanded, so it is made here and deleted after
+                    fst::LabelIndex<A> * index = makeLabelIndex(*rightFst, rightChild_->getIndexArcs(), rightChild_->getName());
+                    try {
+                        fst::ComposeFstOptions<A, FB> copts(CacheOptions(),
+                                      new FB(*leftFst,  ( rightChild_->getFallbackMap() == 0 ? fst::MATCH_OUTPUT : fst::MATCH_NONE ) ),
+                                      new FB(*rightFst, fst::MATCH_INPUT, rightChild_->getFallbackMap(), true, false,
+                                             new IM(*rightFst, fst::MATCH_INPUT, index)));
+                        fst::ComposeFst<A> compFst(*leftFst, *rightFst, copts);
+                        vecRet = new fst::VectorFst<A>(compFst);
+                    } catch(...) {
+                        delete index;
+                        throw;
+                    }
+                    delete index;
                     Connect(vecRet);
                 }
                 else {
@@ -160,7 +288,7 @@ public:
                     fst::Intersect(leftVec, rightVec, vecRet);
                     fst::Decode(vecRet, encoder);
                 }
-                ret = vecRet;
+                ret = storeFst(vecRet);
             }
             else if (operation_ == COMPOSE) {
                 fst::ComposeFstOptions<A, FB> copts(CacheOptions(),
@@ -182,12 +310,13 @@ public:
         // for single operations
         else if(operation_ == MINIMIZE || operation_ == DETERMINIZE || operation_ == PROJECT || operation_ == ARCSORT) {
             assert(leftChild_);
-            fst::Fst<A> * childFst = leftChild_->buildFst();
-            if(operation_ == MINIMIZE) cerr << "Minimizing ";
-            else if(operation_ == DETERMINIZE) cerr << "Determinizing ";
-            else if(operation_ == PROJECT) cerr << "Projecting ";
-            else cerr << "Arc sorting ";
-            cerr << " fst " << leftChild_->getName() << "... ";
+            fst::Fst<A> * childFst = leftChild_->buildFst(cacheDir, budget);
+            if(operation_ == MINIMIZE) progress << "Minimizing";
+            else if(operation_ == DETERMINIZE) progress << "Determinizing";
+            else if(operation_ == PROJECT) progress << "Projecting";
+            else progress << "Arc sorting";
+            progress << " fst " << leftChild_->getName() << "... ";
+            PrintProgress(progress.str());
             if(method_ == STATIC) {
                 fst::VectorFst<A> * vecRet = new fst::VectorFst<A>(*childFst);
 
@@ -209,7 +338,7 @@ public:
                     }
 
                 }
-                ret = vecRet;
+                ret = storeFst(vecRet);
             }
             else {
                 if(operation_ == MINIMIZE)
@@ -230,7 +359,10 @@ public:
         else
             throw std::runtime_error( "Unknown operation for fst::FstNode" );
     
-        cerr << "done" << endl;
+        PrintProgress(progress.str() + "done");
+
+        if(cachePath.length() > 0)
+            saveCachedFst(cachePath, *ret);
 
         return ret;
     
@@ -256,24 +388,184 @@ public:
 
 };
 
+// a node to build in another thread
+template <class A>
+struct FstBuildTask {
+    FstBuildTask(const FstNode<A> * node, const string & cacheDir, ThreadBudget * budget) :
+        node(node), cacheDir(cacheDir), budget(budget), result(0), error() { }
+    const FstNode<A> * node;
+    const string & cacheDir;
+    ThreadBudget * budget;
+    fst::Fst<A> * result;
+    string error;
+};
+
+template <class A>
+void* RunFstBuildTask(void* ptr) {
+    FstBuildTask<A> * task = (FstBuildTask<A>*)ptr;
+    try {
+        task->result = task->node->buildFst(task->cacheDir, task->budget);
+        if(task->result == 0)
+            task->error = "Could not build fst " + task->node->getName();
+    } catch(std::exception & e) {
+        task->error = e.what();
+    }
+    return NULL;
+}
+
+// build the FSTs of several nodes, using as many extra threads as the budget
+//  allows. If any of them fail, all of the built FSTs are deleted.
+template <class A>
+void BuildFstNodes(const std::vector< const FstNode<A>* > & nodes, 
+                   const string & cacheDir, ThreadBudget * budget,
+                   std::vector< fst::Fst<A>* > & fsts) {
+    std::vector< FstBuildTask<A>* > tasks;
+    std::vector<pthread_t> threads;
+    std::vector<bool> started;
+    for(unsigned i = 0; i < nodes.size(); i++) {
+        tasks.push_back(new FstBuildTask<A>(nodes[i], cacheDir, budget));
+        threads.push_back(pthread_t());
+        started.push_back(false);
+    }
+    // start the threads for all but the first node, then build the others
+    //  in this thread
+    for(unsigned i = 1; i < nodes.size(); i++) {
+        if(budget && budget->tryAcquire()) {
+            try {
+                threads[i] = StartThread(RunFstBuildTask<A>, tasks[i]);
+                started[i] = true;
+            } catch(std::exception & e) {
+                budget->release();
+            }
+        }
+    }
+    for(unsigned i = 0; i < nodes.size(); i++)
+        if(!started[i])
+            RunFstBuildTask<A>(tasks[i]);
+    string error;
+    for(unsigned i = 0; i < nodes.size(); i++) {
+        if(started[i]) {
+            pthread_join(threads[i], NULL);
+            budget->release();
+        }
+        if(tasks[i]->result == 0 && error.length() == 0)
+            error = tasks[i]->error;
+    }
+    for(unsigned i = 0; i < nodes.size(); i++) {
+        if(error.length() == 0)
+            fsts.push_back(tasks[i]->result);
+        else
+            delete tasks[i]->result;
+        delete tasks[i];
+    }
+    if(error.length() > 0)
+        throw std::runtime_error(error);
+}
+
+template <class A>
+void FstNode<A>::buildPair(const FstNode<A> & left, const FstNode<A> & right,
+                           const string & cacheDir, ThreadBudget * budget,
+                           fst::Fst<A> * & leftFst, fst::Fst<A> * & rightFst) {
+    std::vector< const FstNode<A>* > nodes;
+    nodes.push_back(&left);
+    nodes.push_back(&right);
+    std::vector< fst::Fst<A>* > fsts;
+    BuildFstNodes(nodes, cacheDir, budget, fsts);
+    leftFst = fsts[0];
+    rightFst = fsts[1];
+}
+
 template<> inline 
 fst::Fst<fst::ComponentArc> * FstNode<fst::ComponentArc>::loadFst() const {
+    fst::Fst<fst::ComponentArc> * mapped = fst::MappedFst<fst::ComponentArc, fst::WeightedComponentMapper>::Open(file_, fst::WeightedComponentMapper(id_, weight_));
+    if(mapped)
+        return mapped;
     fst::StdFst * temp = fst::StdFst::Read(file_.c_str());
-    fst::VectorFst<fst::ComponentArc> * ret = new fst::VectorFst<fst::ComponentArc>();
-    fst::Map(*temp, ret, fst::WeightedComponentMapper(id_, weight_));
+    if(temp == NULL)
+        throw std::runtime_error("Could not read FST file '"+file_+"'");
+    // component weights are much larger than standard ones, so each
+    //  distinct weight is only stored once
+    fst::Fst<fst::ComponentArc> * ret = new fst::InternedComponentFst(*temp, fst::WeightedComponentMapper(id_, weight_));
     delete temp;
     return ret;
 }
 
 template<> inline
 fst::StdFst * FstNode<fst::StdArc>::loadFst() const {
+    fst::StdFst * mapped = fst::MappedFst<fst::StdArc, fst::WeightedMapper>::Open(file_, fst::WeightedMapper(weight_));
+    if(mapped)
+        return mapped;
     fst::StdFst * temp = fst::StdFst::Read(file_.c_str());
+    if(temp == NULL)
+        throw std::runtime_error("Could not read FST file '"+file_+"'");
     fst::VectorFst<fst::StdArc> * ret = new fst::VectorFst<fst::StdArc>();
     fst::Map(*temp, ret, fst::WeightedMapper(weight_));
     delete temp;
     return ret;
 }
 
+template<> inline
+fst::StdFst * FstNode<fst::StdArc>::storeFst(fst::StdVectorFst * fst) const {
+    return fst;
+}
+
+template<> inline
+fst::Fst<fst::ComponentArc> * FstNode<fst::ComponentArc>::storeFst(fst::VectorFst<fst::ComponentArc> * fst) const {
+    fst::Fst<fst::ComponentArc> * ret = new fst::InternedComponentFst(*fst);
+    delete fst;
+    return ret;
+}
+
+// the name of a new temporary file for a cached FST. Identical subtrees
+//  may be built by several threads of the same process at once, so the name
+//  holds a count of the files made by this process as well as its id
+inline string CachedFstTempPath(const string & path) {
+    static ThreadMutex mutex;
+    static unsigned count = 0;
+    std::ostringstream tmp;
+    ThreadLock lock(mutex);
+    tmp << path << ".tmp" << getpid() << "." << count++;
+    return tmp.str();
+}
+
+// write a cached FST to a temporary file and move it into place, so other
+//  decoders never see a half-written file
+template <class F>
+inline void WriteCachedFst(const string & path, const F & fst) {
+    string tmp = CachedFstTempPath(path);
+    if(!fst.Write(tmp) || rename(tmp.c_str(), path.c_str()) != 0) {
+        cerr << "WARNING, could not write the cached fst " << path << endl;
+        unlink(tmp.c_str());
+    }
+}
+
+// cached standard FSTs are written in the const format and memory-mapped
+template<> inline
+fst::StdFst * FstNode<fst::StdArc>::loadCachedFst(const string & path) const {
+    if(access(path.c_str(), R_OK) != 0)
+        return 0;
+    return fst::MappedFst<fst::StdArc, fst::WeightedMapper>::Open(path, fst::WeightedMapper(1));
+}
+
+template<> inline
+void FstNode<fst::StdArc>::saveCachedFst(const string & path, const fst::StdFst & fst) const {
+    WriteCachedFst(path, fst::ConstFst<fst::StdArc>(fst));
+}
+
+// cached component FSTs are read into memory and their weights interned
+template<> inline
+fst::Fst<fst::ComponentArc> * FstNode<fst::ComponentArc>::loadCachedFst(const string & path) const {
+    if(access(path.c_str(), R_OK) != 0)
+        return 0;
+    fst::VectorFst<fst::ComponentArc> * vec = fst::VectorFst<fst::ComponentArc>::Read(path);
+    return (vec ? storeFst(vec) : 0);
+}
+
+template<> inline
+void FstNode<fst::ComponentArc>::saveCachedFst(const string & path, const fst::Fst<fst::ComponentArc> & fst) const {
+    WriteCachedFst(path, fst::VectorFst<fst::ComponentArc>(fst));
+}
+
 }
 
 #endif
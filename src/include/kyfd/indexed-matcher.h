@@ -0,0 +1,223 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// indexed-matcher.h
+//
+//  A matcher that finds the arcs of a label in states with many arcs by
+//   looking it up in a table, instead of the binary search over the sorted
+//   arcs done by OpenFst's matcher. The tables are built once for each
+//   model, and are only worth their memory for states such as the unigram
+//   and backoff states of a language model, which are used for nearly
+//   every word.
+
+#ifndef KYFD_INDEXED_MATCHER_H__
+#define KYFD_INDEXED_MATCHER_H__
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <fst/fst.h>
+#include <fst/matcher.h>
+
+namespace fst {
+
+// the positions of the arcs of each input label in the states of an FST
+//  that have at least a given number of arcs. The FST must be sorted by
+//  input label and have states that do not change between copies (be
+//  expanded), and the index is never changed once it is built, so it can be
+//  shared by matchers in any number of threads. States with labels that are
+//  too spread out to fit in a dense table are left out.
+template <class A>
+class LabelIndex {
+
+public:
+
+    typedef typename A::StateId StateId;
+    typedef typename A::Label Label;
+
+    // an indexed state, the arcs of label l being those from
+    //  positions[offset+l-minLabel] to positions[offset+l-minLabel+1]
+    struct IndexedState {
+        StateId state;
+        Label minLabel;
+        Label maxLabel;
+        size_t offset;
+        bool operator<(const IndexedState & other) const { return state < other.state; }
+    };
+
+    LabelIndex(const Fst<A> & fst, size_t minArcs) {
+        if(!fst.Properties(kILabelSorted, true))
+            throw std::runtime_error("Only FSTs sorted by input label can be indexed");
+        for(StateIterator< Fst<A> > siter(fst); !siter.Done(); siter.Next()) {
+            StateId s = siter.Value();
+            size_t numArcs = fst.NumArcs(s);
+            if(numArcs < minArcs || numArcs == 0)
+                continue;
+            // find the range of labels, leaving out epsilons, which are
+            //  always found by the sorted matcher
+            ArcIterator< Fst<A> > aiter(fst, s);
+            size_t first = 0;
+            while(!aiter.Done() && aiter.Value().ilabel == 0) {
+                aiter.Next();
+                first++;
+            }
+            if(aiter.Done())
+                continue;
+            IndexedState state;
+            state.state = s;
+            state.minLabel = aiter.Value().ilabel;
+            aiter.Seek(numArcs - 1);
+            state.maxLabel = aiter.Value().ilabel;
+            // labels that are too spread out would make a very large table
+            if((size_t)(state.maxLabel - state.minLabel) > kMaxSpread * numArcs)
+                continue;
+            state.offset = positions_.size();
+            // the position of the first arc of each label, or of the next
+            //  label for labels with no arcs
+            positions_.resize(state.offset + state.maxLabel - state.minLabel + 2, numArcs);
+            size_t pos = first;
+            Label next = state.minLabel;
+            for(aiter.Seek(first); !aiter.Done(); aiter.Next(), pos++) {
+                for( ; next <= aiter.Value().ilabel; next++)
+                    positions_[state.offset + next - state.minLabel] = pos;
+            }
+            states_.push_back(state);
+        }
+        // states are visited in order, but this does not rely on it
+        std::sort(states_.begin(), states_.end());
+    }
+
+    // find a state, returning NULL if it is not indexed
+    const IndexedState * GetState(StateId s) const {
+        IndexedState key;
+        key.state = s;
+        typename std::vector<IndexedState>::const_iterator it =
+            std::lower_bound(states_.begin(), states_.end(), key);
+        return (it != states_.end() && it->state == s ? &*it : 0);
+    }
+
+    // find the positions of the arcs with a label in an indexed state
+    void Find(const IndexedState & state, Label label, size_t * begin, size_t * end) const {
+        if(label < state.minLabel || label > state.maxLabel) {
+            *begin = *end = 0;
+            return;
+        }
+        const uint32 * pos = &positions_[state.offset + label - state.minLabel];
+        *begin = pos[0];
+        *end = pos[1];
+    }
+
+    size_t NumStates() const { return states_.size(); }
+
+private:
+
+    // the most labels per arc covered by the table of a state
+    static const size_t kMaxSpread = 16;
+
+    std::vector<IndexedState> states_;
+    std::vector<uint32> positions_;
+
+};
+
+// A matcher that uses a LabelIndex for the states that have one, and
+//  OpenFst's matcher for all others. It is given to FallbackMatcher in
+//  place of the matcher that it wraps. Only input labels are indexed, and
+//  without an index this works the same as OpenFst's matcher.
+template <class F>
+class IndexedMatcher {
+
+public:
+
+    typedef F FST;
+    typedef typename F::Arc Arc;
+    typedef typename Arc::StateId StateId;
+    typedef typename Arc::Label Label;
+
+    IndexedMatcher(const F & fst, MatchType match_type, const LabelIndex<Arc> * index = 0)
+            : matcher_(fst, match_type),
+              index_(match_type == MATCH_INPUT ? index : 0),
+              state_(0), aiter_(0), aiterState_(kNoStateId), indexed_(false), pos_(0), end_(0) { }
+
+    IndexedMatcher(const IndexedMatcher<F> & matcher, bool safe = false)
+            : matcher_(matcher.matcher_, safe),
+              index_(matcher.index_),
+              state_(0), aiter_(0), aiterState_(kNoStateId), indexed_(false), pos_(0), end_(0) { }
+
+    ~IndexedMatcher() {
+        delete aiter_;
+    }
+
+    const F & GetFst() const { return matcher_.GetFst(); }
+
+    MatchType Type(bool test) const { return matcher_.Type(test); }
+
+    void SetState(StateId s) {
+        matcher_.SetState(s);
+        state_ = (index_ ? index_->GetState(s) : 0);
+        indexed_ = false;
+        // the fallback matcher sets the state before every search, so only
+        //  make a new iterator when it changes
+        if(state_ && aiterState_ != s) {
+            delete aiter_;
+            aiter_ = new ArcIterator<F>(matcher_.GetFst(), s);
+            aiterState_ = s;
+        }
+    }
+
+    bool Find(Label match_label) {
+        indexed_ = state_ && match_label != 0 && match_label != kNoLabel;
+        if(!indexed_)
+            return matcher_.Find(match_label);
+        index_->Find(*state_, match_label, &pos_, &end_);
+        if(pos_ >= end_)
+            return false;
+        aiter_->Seek(pos_);
+        return true;
+    }
+
+    bool Done() const { return (indexed_ ? pos_ >= end_ : matcher_.Done()); }
+
+    const Arc & Value() const { return (indexed_ ? aiter_->Value() : matcher_.Value()); }
+
+    void Next() {
+        if(indexed_) {
+            pos_++;
+            aiter_->Next();
+        } else
+            matcher_.Next();
+    }
+
+private:
+
+    Matcher<F> matcher_;
+    const LabelIndex<Arc> * index_;
+    // the index of the current state, or NULL if it has none
+    const typename LabelIndex<Arc>::IndexedState * state_;
+    // an iterator over the arcs of the last indexed state
+    ArcIterator<F> * aiter_;
+    StateId aiterState_;
+    // whether the last label was found with the index, and the positions
+    //  of the arcs that match it
+    bool indexed_;
+    size_t pos_;
+    size_t end_;
+
+    void operator=(const IndexedMatcher<F> &);     // disallow
+
+};
+
+}
+
+#endif // KYFD_INDEXED_MATCHER_H__
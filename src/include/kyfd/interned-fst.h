@@ -0,0 +1,315 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// interned-fst.h
+//
+//  A read-only FST over component arcs that stores each distinct component
+//   weight only once. Arcs hold a handle into a table of weights instead of
+//   the weight itself, which makes them the same size as standard arcs, and
+//   the full arc is only made when it is read. Models tend to use only a
+//   small number of distinct weights (for example all but one component
+//   are zero), so this takes much less memory than a VectorFst.
+
+#ifndef KYFD_INTERNED_FST_H__
+#define KYFD_INTERNED_FST_H__
+
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <fst/fst.h>
+#include <fst/test-properties.h>
+#include <kyfd/component-arc.h>
+#include <kyfd/mapped-fst.h>
+#include <kyfd/threads.h>
+
+namespace fst {
+
+// the handle of an empty bucket in a ComponentWeightTable
+const uint32 kNoWeightHandle = ~0u;
+
+// a table holding each distinct component weight once, found by a handle.
+//  Weights are the same only if their components are identical bit for bit
+class ComponentWeightTable {
+
+public:
+
+    ComponentWeightTable() : buckets_(1024, kNoWeightHandle) { }
+
+    // get the handle of a weight, adding it to the table if it is new
+    uint32 intern(const ComponentWeight & w) {
+        size_t mask = buckets_.size() - 1;
+        for(size_t b = hashWeight(w) & mask; ; b = (b + 1) & mask) {
+            uint32 & handle = buckets_[b];
+            if(handle == kNoWeightHandle) {
+                handle = weights_.size();
+                weights_.push_back(w);
+                // keep the buckets at most half full
+                if(weights_.size() * 2 > buckets_.size())
+                    rehash();
+                return weights_.size() - 1;
+            } else if(sameWeight(weights_[handle], w))
+                return handle;
+        }
+    }
+
+    const ComponentWeight & operator[](uint32 handle) const { return weights_[handle]; }
+    size_t size() const { return weights_.size(); }
+
+    // the weights are only needed once all of them have been interned
+    void clearIndex() { std::vector<uint32>().swap(buckets_); }
+
+private:
+
+    static bool sameWeight(const ComponentWeight & w1, const ComponentWeight & w2) {
+        return w1.getWidth() == w2.getWidth() &&
+            !memcmp(w1.getComponents(), w2.getComponents(), w1.getWidth()*sizeof(float));
+    }
+
+    // FNV-1a over the bytes of the components
+    static size_t hashWeight(const ComponentWeight & w) {
+        const unsigned char * bytes = (const unsigned char*)w.getComponents();
+        size_t ret = 2166136261u ^ w.getWidth();
+        for(size_t i = 0; i < w.getWidth()*sizeof(float); i++)
+            ret = (ret ^ bytes[i]) * 16777619u;
+        return ret;
+    }
+
+    void rehash() {
+        std::vector<uint32> buckets(buckets_.size() * 2, kNoWeightHandle);
+        size_t mask = buckets.size() - 1;
+        for(uint32 i = 0; i < weights_.size(); i++) {
+            size_t b = hashWeight(weights_[i]) & mask;
+            while(buckets[b] != kNoWeightHandle)
+                b = (b + 1) & mask;
+            buckets[b] = i;
+        }
+        buckets_.swap(buckets);
+    }
+
+    std::vector<ComponentWeight> weights_;
+    // open addressing over the handles of the weights
+    std::vector<uint32> buckets_;
+
+};
+
+// an arc with its weight replaced by a handle
+struct InternedArc {
+    ComponentArc::Label ilabel;
+    ComponentArc::Label olabel;
+    uint32 weight;
+    ComponentArc::StateId nextstate;
+};
+
+struct InternedState {
+    uint32 final;
+    uint32 pos;
+    uint32 narcs;
+    uint32 niepsilons;
+    uint32 noepsilons;
+};
+
+// the data shared between copies of an InternedComponentFst, which is
+//  never changed once it is built
+struct InternedFstData {
+    InternedFstData() : start(kNoStateId), properties(0) { }
+    ComponentWeightTable weights;
+    std::vector<InternedState> states;
+    std::vector<InternedArc> arcs;
+    ComponentArc::StateId start;
+    uint64 properties;
+    kyfd::RefCount refCount;
+};
+
+// an arc iterator that looks up the weight of each arc as it is read
+class InternedArcIterator : public ArcIteratorBase<ComponentArc> {
+
+public:
+
+    InternedArcIterator(const InternedArc * arcs, size_t narcs, const ComponentWeightTable & weights) :
+        arcs_(arcs), narcs_(narcs), pos_(0), weights_(weights), lastWeight_(kNoWeightHandle) { }
+
+    bool Done() const { return pos_ >= narcs_; }
+    const ComponentArc& Value() const {
+        const InternedArc & arc = arcs_[pos_];
+        arc_.ilabel = arc.ilabel;
+        arc_.olabel = arc.olabel;
+        arc_.nextstate = arc.nextstate;
+        // neighboring arcs often share a weight, so only copy it on changes
+        if(arc.weight != lastWeight_) {
+            arc_.weight = weights_[arc.weight];
+            lastWeight_ = arc.weight;
+        }
+        return arc_;
+    }
+    void Next() { ++pos_; }
+    size_t Position() const { return pos_; }
+    void Reset() { pos_ = 0; }
+    void Seek(size_t a) { pos_ = a; }
+    uint32 Flags() const { return kArcValueFlags; }
+    void SetFlags(uint32 flags, uint32 mask) { }
+
+private:
+
+    virtual bool Done_() const { return Done(); }
+    virtual const ComponentArc& Value_() const { return Value(); }
+    virtual void Next_() { Next(); }
+    virtual size_t Position_() const { return Position(); }
+    virtual void Reset_() { Reset(); }
+    virtual void Seek_(size_t a) { Seek(a); }
+    virtual uint32 Flags_() const { return Flags(); }
+    virtual void SetFlags_(uint32 flags, uint32 mask) { SetFlags(flags, mask); }
+
+    const InternedArc * arcs_;
+    size_t narcs_;
+    size_t pos_;
+    const ComponentWeightTable & weights_;
+    mutable ComponentArc arc_;
+    mutable uint32 lastWeight_;
+
+};
+
+class InternedComponentFst : public Fst<ComponentArc> {
+
+public:
+
+    typedef ComponentArc Arc;
+    typedef ComponentArc::Weight Weight;
+    typedef ComponentArc::StateId StateId;
+
+    // copy an FST, visiting every state
+    explicit InternedComponentFst(const Fst<ComponentArc> & fst) : data_(new InternedFstData) {
+        try {
+            init(fst, NoMapper(), kMappedProperties | kWeighted | kUnweighted);
+        } catch(...) {
+            delete data_;
+            throw;
+        }
+    }
+
+    // copy an FST over other arcs, converting them with a mapper (such as
+    //  WeightedComponentMapper) as they are added
+    template <class A, class M>
+    InternedComponentFst(const Fst<A> & fst, const M & mapper) : data_(new InternedFstData) {
+        try {
+            init(fst, mapper, kMappedProperties);
+        } catch(...) {
+            delete data_;
+            throw;
+        }
+    }
+
+    // copies share the same data, and may be made in any thread
+    InternedComponentFst(const InternedComponentFst & fst) : data_(fst.data_) {
+        data_->refCount.increment();
+    }
+
+    ~InternedComponentFst() {
+        if(data_->refCount.decrement())
+            delete data_;
+    }
+
+    StateId Start() const { return data_->start; }
+    Weight Final(StateId s) const { return data_->weights[data_->states[s].final]; }
+    size_t NumArcs(StateId s) const { return data_->states[s].narcs; }
+    size_t NumInputEpsilons(StateId s) const { return data_->states[s].niepsilons; }
+    size_t NumOutputEpsilons(StateId s) const { return data_->states[s].noepsilons; }
+
+    // the properties are found when the FST is built (see
+    //  FindStoredProperties), so testing them gives the stored value
+    uint64 Properties(uint64 mask, bool test) const {
+        return data_->properties & mask;
+    }
+
+    const std::string& Type() const {
+        static const std::string type = "interned";
+        return type;
+    }
+
+    InternedComponentFst * Copy(bool safe = false) const {
+        return new InternedComponentFst(*this);
+    }
+
+    const SymbolTable* InputSymbols() const { return 0; }
+    const SymbolTable* OutputSymbols() const { return 0; }
+
+    // the number of distinct weights, for reporting
+    size_t NumWeights() const { return data_->weights.size(); }
+
+    void InitStateIterator(StateIteratorData<Arc> *data) const {
+        data->base = 0;
+        data->nstates = data_->states.size();
+    }
+
+    void InitArcIterator(StateId s, ArcIteratorData<Arc> *data) const {
+        const InternedState & state = data_->states[s];
+        data->base = new InternedArcIterator(state.narcs ? &data_->arcs[state.pos] : 0, state.narcs, data_->weights);
+        data->arcs = 0;
+        data->narcs = 0;
+        data->ref_count = 0;
+    }
+
+private:
+
+    // a mapper that leaves component arcs as they are
+    struct NoMapper {
+        const ComponentArc & operator()(const ComponentArc & arc) const { return arc; }
+    };
+
+    // copy the arcs, keeping the given properties of the original FST
+    template <class A, class M>
+    void init(const Fst<A> & fst, const M & mapper, uint64 kept);
+
+    InternedFstData * data_;
+
+    void operator=(const InternedComponentFst &);   // disallow
+
+};
+
+template <class A, class M>
+void InternedComponentFst::init(const Fst<A> & fst, const M & mapper, uint64 kept) {
+    InternedFstData & data = *data_;
+    data.start = fst.Start();
+    // the first handle is zero, which is the final weight of any state that
+    //  the iterator skips
+    InternedState empty = { data.weights.intern(Weight::Zero()), 0, 0, 0, 0 };
+    for(StateIterator< Fst<A> > siter(fst); !siter.Done(); siter.Next()) {
+        typename A::StateId s = siter.Value();
+        if((size_t)s >= data.states.size())
+            data.states.resize(s + 1, empty);
+        InternedState & state = data.states[s];
+        state.final = data.weights.intern(mapper(A(0, 0, fst.Final(s), kNoStateId)).weight);
+        state.pos = data.arcs.size();
+        for(ArcIterator< Fst<A> > aiter(fst, s); !aiter.Done(); aiter.Next()) {
+            const ComponentArc & arc = mapper(aiter.Value());
+            InternedArc interned = { arc.ilabel, arc.olabel, data.weights.intern(arc.weight), arc.nextstate };
+            data.arcs.push_back(interned);
+            if(arc.ilabel == 0) state.niepsilons++;
+            if(arc.olabel == 0) state.noepsilons++;
+        }
+        state.narcs = data.arcs.size() - state.pos;
+        if(data.arcs.size() > ~0u)
+            throw std::runtime_error("Too many arcs to store in an interned FST");
+    }
+    data.weights.clearIndex();
+    std::vector<InternedArc>(data.arcs).swap(data.arcs);
+    // the weights are only copied exactly without a mapper, otherwise only
+    //  the properties that do not depend on them are kept
+    data.properties = kExpanded | (fst.Properties(kept, false) & kept);
+    data.properties = FindStoredProperties(*this, data.properties);
+}
+
+}
+
+#endif // KYFD_INTERNED_FST_H__
@@ -0,0 +1,351 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// mapped-fst.h
+//
+//  A read-only FST that is memory-mapped from a file written in OpenFst's
+//   "const" format (for example with "fstconvert --fst_type=const"). Nothing
+//   is read at load time, pages are only brought in as states are visited
+//   and are shared with any other process that maps the same file. Arcs
+//   are converted with a mapper (such as WeightedMapper) as they are read.
+
+#ifndef KYFD_MAPPED_FST_H__
+#define KYFD_MAPPED_FST_H__
+
+#include <string>
+#include <istream>
+#include <streambuf>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fst/fst.h>
+#include <fst/test-properties.h>
+#include <kyfd/component-map.h>
+#include <kyfd/threads.h>
+
+namespace fst {
+
+// a file mapped into memory, unmapped when destroyed
+class MappedFile {
+
+public:
+
+    MappedFile(const std::string & fileName) : data_(0), size_(0) {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) < 0) {
+            if(fd >= 0) close(fd);
+            throw std::runtime_error("Could not open FST file '"+fileName+"'");
+        }
+        size_ = st.st_size;
+        void * data = (size_ ? mmap(0, size_, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED);
+        close(fd);
+        if(data == MAP_FAILED)
+            throw std::runtime_error("Could not map FST file '"+fileName+"'");
+        data_ = (const char*)data;
+    }
+
+    ~MappedFile() {
+        munmap((void*)data_, size_);
+    }
+
+    const char* getData() const { return data_; }
+    size_t getSize() const { return size_; }
+
+private:
+
+    const char* data_;
+    size_t size_;
+
+    MappedFile(const MappedFile &);         // disallow
+    void operator=(const MappedFile &);     // disallow
+
+};
+
+// a stream buffer for reading the header out of mapped memory
+class MemoryStreamBuf : public std::streambuf {
+
+public:
+
+    MemoryStreamBuf(const char* data, size_t size) {
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+        char* pos = (dir == std::ios_base::beg ? eback() :
+                    (dir == std::ios_base::end ? egptr() : gptr())) + off;
+        if(pos < eback() || pos > egptr())
+            return pos_type(off_type(-1));
+        setg(eback(), pos, egptr());
+        return pos_type(pos - eback());
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+
+};
+
+// the on-disk layout of a state in a ConstFst over standard arcs
+struct MappedState {
+    TropicalWeight final;
+    uint32 pos;
+    uint32 narcs;
+    uint32 niepsilons;
+    uint32 noepsilons;
+};
+
+// the data shared between copies of a MappedFst
+struct MappedFstData {
+    MappedFstData(const std::string & fileName) :
+        file(fileName), states(0), arcs(0), numStates(0), start(kNoStateId), properties(0) { }
+    MappedFile file;
+    const MappedState * states;
+    const StdArc * arcs;
+    size_t numStates;
+    StdArc::StateId start;
+    uint64 properties;
+    kyfd::RefCount refCount;
+};
+
+// whether a mapper leaves arcs as they are, in which case the mapped arcs
+//  can be handed out directly
+template <class M>
+inline bool IsIdentityMapper(const M & mapper) { return false; }
+template <>
+inline bool IsIdentityMapper(const WeightedMapper & mapper) { return mapper.weight_ == 1; }
+
+// an arc iterator that maps each arc as it is read
+template <class A, class M>
+class MappedArcIterator : public ArcIteratorBase<A> {
+
+public:
+
+    MappedArcIterator(const StdArc * arcs, size_t narcs, const M & mapper) :
+        arcs_(arcs), narcs_(narcs), pos_(0), mapper_(mapper) { }
+
+    bool Done() const { return pos_ >= narcs_; }
+    const A& Value() const {
+        arc_ = mapper_(arcs_[pos_]);
+        return arc_;
+    }
+    void Next() { ++pos_; }
+    size_t Position() const { return pos_; }
+    void Reset() { pos_ = 0; }
+    void Seek(size_t a) { pos_ = a; }
+    uint32 Flags() const { return kArcValueFlags; }
+    void SetFlags(uint32 flags, uint32 mask) { }
+
+private:
+
+    virtual bool Done_() const { return Done(); }
+    virtual const A& Value_() const { return Value(); }
+    virtual void Next_() { Next(); }
+    virtual size_t Position_() const { return Position(); }
+    virtual void Reset_() { Reset(); }
+    virtual void Seek_(size_t a) { Seek(a); }
+    virtual uint32 Flags_() const { return Flags(); }
+    virtual void SetFlags_(uint32 flags, uint32 mask) { SetFlags(flags, mask); }
+
+    const StdArc * arcs_;
+    size_t narcs_;
+    size_t pos_;
+    M mapper_;
+    mutable A arc_;
+
+};
+
+template <class A, class M>
+class MappedFst : public Fst<A> {
+
+public:
+
+    typedef A Arc;
+    typedef typename A::Weight Weight;
+    typedef typename A::StateId StateId;
+
+    // map a file, returning NULL if it is not a ConstFst over standard arcs
+    //  or its layout cannot be read in place
+    static MappedFst<A, M> * Open(const std::string & fileName, const M & mapper);
+
+    MappedFst(const MappedFst<A, M> & fst) : data_(fst.data_), mapper_(fst.mapper_) {
+        data_->refCount.increment();
+    }
+
+    ~MappedFst() {
+        if(data_->refCount.decrement())
+            delete data_;
+    }
+
+    StateId Start() const { return data_->start; }
+    Weight Final(StateId s) const {
+        return mapper_(StdArc(0, 0, data_->states[s].final, kNoStateId)).weight;
+    }
+    size_t NumArcs(StateId s) const { return data_->states[s].narcs; }
+    size_t NumInputEpsilons(StateId s) const { return data_->states[s].niepsilons; }
+    size_t NumOutputEpsilons(StateId s) const { return data_->states[s].noepsilons; }
+
+    // the properties are found when the file is opened (see
+    //  FindStoredProperties), so testing them gives the stored value
+    uint64 Properties(uint64 mask, bool test) const {
+        return data_->properties & mask;
+    }
+
+    const std::string& Type() const {
+        static const std::string type = "mapped";
+        return type;
+    }
+
+    MappedFst<A, M> * Copy(bool safe = false) const {
+        return new MappedFst<A, M>(*this);
+    }
+
+    const SymbolTable* InputSymbols() const { return 0; }
+    const SymbolTable* OutputSymbols() const { return 0; }
+
+    void InitStateIterator(StateIteratorData<A> *data) const {
+        data->base = 0;
+        data->nstates = data_->numStates;
+    }
+
+    void InitArcIterator(StateId s, ArcIteratorData<A> *data) const {
+        const MappedState & state = data_->states[s];
+        data->ref_count = 0;
+        if(IsIdentityMapper(mapper_)) {
+            // only true for standard arcs, which need no conversion. Open
+            //  checks that the arcs are aligned in the mapping
+            data->base = 0;
+            data->arcs = reinterpret_cast<const A*>(data_->arcs + state.pos);
+            data->narcs = state.narcs;
+        } else {
+            data->base = new MappedArcIterator<A, M>(data_->arcs + state.pos, state.narcs, mapper_);
+            data->arcs = 0;
+            data->narcs = 0;
+        }
+    }
+
+private:
+
+    MappedFst(MappedFstData * data, const M & mapper) : data_(data), mapper_(mapper) { }
+
+    MappedFstData * data_;
+    M mapper_;
+
+    void operator=(const MappedFst<A, M> &);   // disallow
+
+};
+
+// the properties that do not depend on the weights, and so are kept
+//  when arcs are mapped
+const uint64 kMappedProperties = kAcceptor | kNotAcceptor
+    | kIDeterministic | kNonIDeterministic | kODeterministic | kNonODeterministic
+    | kEpsilons | kNoEpsilons | kIEpsilons | kNoIEpsilons | kOEpsilons | kNoOEpsilons
+    | kILabelSorted | kNotILabelSorted | kOLabelSorted | kNotOLabelSorted
+    | kCyclic | kAcyclic | kInitialCyclic | kInitialAcyclic | kTopSorted | kNotTopSorted
+    | kAccessible | kNotAccessible | kCoAccessible | kNotCoAccessible | kString | kNotString;
+
+// the properties tested by the matchers
+const uint64 kMatcherProperties = kAcceptor | kILabelSorted | kOLabelSorted;
+
+// add the matcher properties of an FST that are not already known to the
+//  properties that it stores. Read-only FSTs whose data is shared between
+//  threads find these once when they are made, and afterwards answer every
+//  query from the stored properties instead of computing them again
+template <class A>
+uint64 FindStoredProperties(const Fst<A> & fst, uint64 props) {
+    if((KnownProperties(props) & kMatcherProperties) != kMatcherProperties) {
+        uint64 known;
+        props |= ComputeProperties(fst, kMatcherProperties, &known, false) & known & kMappedProperties;
+    }
+    return props;
+}
+
+// the end of the padding that AlignInput skips to reach a multiple of align
+inline size_t AlignOffset(size_t pos, size_t align) {
+    return (pos + align - 1) / align * align;
+}
+
+template <class A, class M>
+MappedFst<A, M> * MappedFst<A, M>::Open(const std::string & fileName, const M & mapper) {
+
+    MappedFstData * data = new MappedFstData(fileName);
+    const MappedFile & file = data->file;
+    MemoryStreamBuf buf(file.getData(), file.getSize());
+    std::istream strm(&buf);
+
+    // read the header and skip the symbol tables
+    FstHeader hdr;
+    if(!hdr.Read(strm, fileName) || hdr.FstType() != "const" || hdr.ArcType() != StdArc::Type()) {
+        delete data;
+        return 0;
+    }
+    if(hdr.GetFlags() & FstHeader::HAS_ISYMBOLS)
+        delete SymbolTable::Read(strm, fileName);
+    if(hdr.GetFlags() & FstHeader::HAS_OSYMBOLS)
+        delete SymbolTable::Read(strm, fileName);
+    if(!strm) {
+        delete data;
+        throw std::runtime_error("Could not read the header of FST file '"+fileName+"'");
+    }
+
+    // find the states and arcs. Aligned files (including all version 1
+    //  files) pad the start of each to a multiple of an alignment, which is
+    //  the size of a state and of an arc in some versions of OpenFst and 16
+    //  bytes in others, so only a layout that ends exactly at the end of the
+    //  file is used. Files that match neither are read in the usual way
+    bool aligned = hdr.Version() == 1 || (hdr.GetFlags() & FstHeader::IS_ALIGNED);
+    size_t headerEnd = strm.tellg();
+    size_t stateAligns[] = { sizeof(MappedState), 16 }, arcAligns[] = { sizeof(StdArc), 16 };
+    size_t statesPos = 0, arcsPos = 0, endPos = 0;
+    bool found = false, truncated = true;
+    for(int i = 0; i < (aligned ? 2 : 1) && !found; i++) {
+        statesPos = (aligned ? AlignOffset(headerEnd, stateAligns[i]) : headerEnd);
+        arcsPos = statesPos + hdr.NumStates() * sizeof(MappedState);
+        if(aligned)
+            arcsPos = AlignOffset(arcsPos, arcAligns[i]);
+        endPos = arcsPos + hdr.NumArcs() * sizeof(StdArc);
+        found = (endPos == file.getSize());
+        truncated = truncated && endPos > file.getSize();
+    }
+    if(truncated) {
+        delete data;
+        throw std::runtime_error("FST file '"+fileName+"' is truncated");
+    }
+    // the states and arcs are read in place, which needs them to be aligned
+    //  for their 4-byte members
+    if(!found || statesPos % sizeof(uint32) != 0 || arcsPos % sizeof(uint32) != 0) {
+        delete data;
+        return 0;
+    }
+    data->states = (const MappedState*)(file.getData() + statesPos);
+    data->arcs = (const StdArc*)(file.getData() + arcsPos);
+    data->numStates = hdr.NumStates();
+    data->start = hdr.Start();
+
+    data->properties = kExpanded | (hdr.Properties() & kMappedProperties);
+
+    MappedFst<A, M> * ret = new MappedFst<A, M>(data, mapper);
+    data->properties = FindStoredProperties(*ret, data->properties);
+    return ret;
+}
+
+}
+
+#endif // KYFD_MAPPED_FST_H__
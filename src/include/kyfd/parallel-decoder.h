@@ -0,0 +1,84 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// parallel-decoder.h
+//
+//  Decodes sentences in several threads that share a single decoder's
+//   models, writing the results in the order of the input
+
+#ifndef KYFD_PARALLEL_DECODER_H__
+#define KYFD_PARALLEL_DECODER_H__
+
+#include <map>
+#include <string>
+#include <iostream>
+#include <kyfd/decoder.h>
+#include <kyfd/threads.h>
+
+namespace kyfd {
+
+class ParallelDecoder {
+
+public:
+
+    // at most queueSize sentences are read but not yet written at once, so
+    //  a slow sentence cannot make the results after it pile up
+    ParallelDecoder(Decoder & decoder, unsigned numThreads, unsigned queueSize);
+
+    // decode all sentences in the input, returning the number decoded
+    int decode(std::istream & in, std::ostream & out);
+
+private:
+
+    // the function run by each thread
+    static void* runWorker(void* ptr);
+    void work();
+
+    // read the next sentence and give it an id, waiting while the window
+    //  of sentences that have not been written is full
+    bool readSentence(std::string & sentence, int & id);
+
+    // write a result, or hold it until all previous results are written
+    void writeResult(int id, const std::string & result);
+
+    // stop all threads after an error
+    void setError(const std::string & error);
+
+    Decoder & decoder_;
+    unsigned numThreads_;
+    unsigned queueSize_;
+
+    // input handling
+    std::istream * in_;
+    ThreadMutex inMutex_;
+    int nextRead_;
+    bool failed_;
+    std::string error_;
+    // the number of results written, which is also protected by inMutex_
+    //  so readers can wait on it
+    int numWritten_;
+    ThreadCondition window_;
+
+    // output handling
+    std::ostream * out_;
+    ThreadMutex outMutex_;
+    int nextWrite_;
+    std::map<int, std::string> pending_;
+
+};
+
+}
+
+#endif // KYFD_PARALLEL_DECODER_H__
@@ -0,0 +1,83 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// pipeline-decoder.h
+//
+//  Decodes in a three-stage pipeline: a reader thread that converts the
+//   input into FSTs, several threads that search, and a writer thread that
+//   prints the results in the order of the input. The number of sentences
+//   between the reader and the writer is limited, so memory use stays
+//   bounded however large the input is.
+
+#ifndef KYFD_PIPELINE_DECODER_H__
+#define KYFD_PIPELINE_DECODER_H__
+
+#include <string>
+#include <iostream>
+#include <kyfd/decoder.h>
+#include <kyfd/threads.h>
+
+namespace kyfd {
+
+class PipelineDecoder {
+
+public:
+
+    PipelineDecoder(Decoder & decoder, unsigned numThreads, unsigned queueSize);
+
+    ~PipelineDecoder();
+
+    // decode all sentences in the input, returning the number decoded. This
+    //  can only be called once for each pipeline.
+    int decode(std::istream & in, std::ostream & out);
+
+private:
+
+    // the functions run by each thread
+    static void* runReader(void* ptr);
+    static void* runWorker(void* ptr);
+    static void* runWriter(void* ptr);
+    void read();
+    void work();
+    void write();
+
+    // stop all threads after an error
+    void setError(const std::string & error);
+    bool isFailed();
+
+    Decoder & decoder_;
+    unsigned numThreads_;
+    unsigned queueSize_;
+    std::istream * in_;
+    std::ostream * out_;
+
+    // sentences waiting to be searched, and results waiting to be printed
+    BoundedQueue<DecodeInput*> inputs_;
+    BoundedQueue<DecodeResult*> results_;
+
+    // limits the number of sentences between the reader and the writer
+    ThreadMutex mutex_;
+    ThreadCondition window_;
+    int numRead_;
+    int numWritten_;
+    unsigned activeWorkers_;
+    bool failed_;
+    std::string error_;
+
+};
+
+}
+
+#endif // KYFD_PIPELINE_DECODER_H__
@@ -0,0 +1,86 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// search-stats.h
+//
+//  Counts of the work done while searching a single sentence, written as
+//   one line of JSON per sentence
+
+#ifndef KYFD_SEARCH_STATS_H__
+#define KYFD_SEARCH_STATS_H__
+
+#include <vector>
+#include <iostream>
+#include <fst/fst.h>
+#include <kyfd/fallback-matcher.h>
+#include <kyfd/beam-trim.h>
+
+namespace kyfd {
+
+class SearchStats {
+
+public:
+
+    SearchStats() : compose_(), trim_(), states_(0), arcs_(0) { }
+
+    // get the counts for each of the composed models, which must have been
+    //  sized before the matchers are pointed at them
+    std::vector<fst::FallbackMatcherCounts> & getCompose() { return compose_; }
+    fst::BeamTrimCounts & getTrim() { return trim_; }
+
+    // count the size of the FST of best paths found by the search. The
+    //  composed FST that is searched is lazy, so its size is given by the
+    //  states expanded in each composition instead of by visiting it, which
+    //  would expand states that the search never does
+    template <class A>
+    void countResult(const fst::Fst<A> & bestFst) {
+        for(fst::StateIterator< fst::Fst<A> > siter(bestFst); !siter.Done(); siter.Next()) {
+            states_++;
+            arcs_ += bestFst.NumArcs(siter.Value());
+        }
+    }
+
+    // write the counts as a single line of JSON
+    void writeJson(std::ostream & out, int id) const {
+        out << "{\"id\": " << id << ", \"compose\": [";
+        for(unsigned i = 0; i < compose_.size(); i++) {
+            if(i) out << ", ";
+            out << "{\"states\": " << compose_[i].states
+                << ", \"arcs\": " << compose_[i].arcs
+                << ", \"fallbacks\": " << compose_[i].fallbacks
+                << ", \"cachehits\": " << compose_[i].cacheHits
+                << ", \"cachemisses\": " << compose_[i].cacheMisses << "}";
+        }
+        out << "], \"trim\": {\"steps\": " << trim_.steps
+            << ", \"inserted\": " << trim_.inserted
+            << ", \"pruned\": " << trim_.pruned
+            << ", \"recombined\": " << trim_.recombined
+            << "}, \"result\": {\"states\": " << states_
+            << ", \"arcs\": " << arcs_ << "}}" << std::endl;
+    }
+
+private:
+
+    std::vector<fst::FallbackMatcherCounts> compose_;
+    fst::BeamTrimCounts trim_;
+    // the size of the FST of best paths
+    uint64 states_;
+    uint64 arcs_;
+
+};
+
+}
+
+#endif // KYFD_SEARCH_STATS_H__
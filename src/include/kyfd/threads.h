@@ -0,0 +1,225 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// threads.h
+//
+//  Thin wrappers around pthreads. OpenFst's own fst::Mutex is a no-op, so
+//   anything that is actually shared between decoding threads must be
+//   protected with these instead.
+
+#ifndef KYFD_THREADS_H__
+#define KYFD_THREADS_H__
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <iostream>
+#include <stdexcept>
+
+namespace kyfd {
+
+// a simple mutex
+class ThreadMutex {
+
+public:
+
+    ThreadMutex() { pthread_mutex_init(&mutex_, NULL); }
+    ~ThreadMutex() { pthread_mutex_destroy(&mutex_); }
+
+    void lock() { pthread_mutex_lock(&mutex_); }
+    void unlock() { pthread_mutex_unlock(&mutex_); }
+
+    pthread_mutex_t * get() { return &mutex_; }
+
+private:
+
+    pthread_mutex_t mutex_;
+
+    ThreadMutex(const ThreadMutex &);       // disallow
+    void operator=(const ThreadMutex &);    // disallow
+
+};
+
+// hold a mutex for the lifetime of the object
+class ThreadLock {
+
+public:
+
+    ThreadLock(ThreadMutex & mutex) : mutex_(mutex) { mutex_.lock(); }
+    ~ThreadLock() { mutex_.unlock(); }
+
+private:
+
+    ThreadMutex & mutex_;
+
+    ThreadLock(const ThreadLock &);         // disallow
+    void operator=(const ThreadLock &);     // disallow
+
+};
+
+// a reference count shared by copies of an object, which may be made and
+//  deleted in different threads
+class RefCount {
+
+public:
+
+    RefCount() : count_(1) { }
+
+    void increment() {
+        ThreadLock lock(mutex_);
+        count_++;
+    }
+
+    // returns true once the last reference is gone
+    bool decrement() {
+        ThreadLock lock(mutex_);
+        return --count_ == 0;
+    }
+
+private:
+
+    ThreadMutex mutex_;
+    int count_;
+
+    RefCount(const RefCount &);             // disallow
+    void operator=(const RefCount &);       // disallow
+
+};
+
+// a condition variable, always used together with a ThreadMutex
+class ThreadCondition {
+
+public:
+
+    ThreadCondition() { pthread_cond_init(&cond_, NULL); }
+    ~ThreadCondition() { pthread_cond_destroy(&cond_); }
+
+    // the mutex must be held by the caller
+    void wait(ThreadMutex & mutex) { pthread_cond_wait(&cond_, mutex.get()); }
+    void signal() { pthread_cond_signal(&cond_); }
+    void broadcast() { pthread_cond_broadcast(&cond_); }
+
+private:
+
+    pthread_cond_t cond_;
+
+    ThreadCondition(const ThreadCondition &);   // disallow
+    void operator=(const ThreadCondition &);    // disallow
+
+};
+
+// a queue that makes pushing threads wait while it is full, and popping 
+//  threads wait while it is empty
+template <class T>
+class BoundedQueue {
+
+public:
+
+    BoundedQueue(unsigned capacity) : capacity_(capacity), closed_(false) { }
+
+    // add an item, returning false if the queue has been closed
+    bool push(const T & item) {
+        ThreadLock lock(mutex_);
+        while(!closed_ && queue_.size() >= capacity_)
+            notFull_.wait(mutex_);
+        if(closed_)
+            return false;
+        queue_.push_back(item);
+        notEmpty_.signal();
+        return true;
+    }
+
+    // take an item, returning false once the queue is closed and empty
+    bool pop(T & item) {
+        ThreadLock lock(mutex_);
+        while(!closed_ && queue_.empty())
+            notEmpty_.wait(mutex_);
+        if(queue_.empty())
+            return false;
+        item = queue_.front();
+        queue_.pop_front();
+        notFull_.signal();
+        return true;
+    }
+
+    // stop accepting items and wake up all waiting threads
+    void close() {
+        ThreadLock lock(mutex_);
+        closed_ = true;
+        notEmpty_.broadcast();
+        notFull_.broadcast();
+    }
+
+private:
+
+    std::deque<T> queue_;
+    unsigned capacity_;
+    bool closed_;
+    ThreadMutex mutex_;
+    ThreadCondition notEmpty_;
+    ThreadCondition notFull_;
+
+};
+
+// start a thread running func(arg), throwing on failure
+inline pthread_t StartThread(void* (*func)(void*), void* arg) {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, func, arg) != 0)
+        throw std::runtime_error("Could not create a decoding thread");
+    return thread;
+}
+
+// a limited number of extra threads shared by tasks that can run either in
+//  a new thread or in the thread that needs them
+class ThreadBudget {
+
+public:
+
+    ThreadBudget(unsigned threads) : available_(threads) { }
+
+    // take a thread if one is available, which must be released later
+    bool tryAcquire() {
+        ThreadLock lock(mutex_);
+        if(available_ == 0)
+            return false;
+        available_--;
+        return true;
+    }
+    void release() {
+        ThreadLock lock(mutex_);
+        available_++;
+    }
+
+private:
+
+    ThreadMutex mutex_;
+    unsigned available_;
+
+    ThreadBudget(const ThreadBudget &);     // disallow
+    void operator=(const ThreadBudget &);   // disallow
+
+};
+
+// print a whole line to standard error without other threads' output
+//  getting mixed into it
+inline void PrintProgress(const std::string & line) {
+    static ThreadMutex mutex;
+    ThreadLock lock(mutex);
+    std::cerr << line << std::endl;
+}
+
+}
+
+#endif // KYFD_THREADS_H__
@@ -37,6 +37,16 @@ inline unsigned long stringToUnsignedLong(const string &str) {
     return (unsigned long)atoi(str.c_str());
 }
 
+// a 64-bit FNV-1a hash of a string
+inline uint64 hashString(const string &str) {
+    uint64 hash = 14695981039346656037ULL;
+    for(unsigned i = 0; i < str.length(); i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 inline float logExp(float x) { return log(1.0F + exp(-x)); }
 
 inline float logPlus(const float& f1, const float& f2) {
@@ -0,0 +1,291 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// viterbi-search.h
+//
+//  A single-pass token-passing search for the best path through a WFST.
+//   The FST is walked one non-epsilon input symbol at a time like BeamTrim,
+//   but instead of adding the surviving arcs to a pruned FST that must be
+//   searched again, each token keeps a backpointer and the best path is
+//   read back from the tokens once the search is done.
+
+#ifndef KYFD_VITERBI_SEARCH_H__
+#define KYFD_VITERBI_SEARCH_H__
+
+#include <vector>
+#include <algorithm>
+#include <fst/fst.h>
+#include <fst/mutable-fst.h>
+#include <kyfd/beam-trim.h>
+
+namespace fst {
+
+// The state of a single Viterbi search. Each step holds at most one token
+//  per state, the best one to reach it, and at most beamWidth tokens are
+//  carried over to the next step. Tokens in the current step are expanded
+//  best first, so states reached again through epsilon arcs are only
+//  expanded once. A threshold works as it does for BeamTrim.
+template <class Arc>
+class ViterbiSearcher {
+
+public:
+
+    typedef typename Arc::StateId StateId;
+    typedef typename Arc::Weight Weight;
+
+    ViterbiSearcher(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth,
+                    BeamTrimCounts * counts, const Weight & threshold) :
+        ifst_(ifst), ofst_(ofst), beamWidth_(beamWidth), counts_(counts), threshold_(threshold),
+        expanded_(0), bestNext_(std::pair<unsigned,unsigned>(0, 0)), bestFinal_(Weight::Zero()), finalState_(kNoStateId), finalTrace_(-1) { }
+
+    void search();
+
+private:
+
+    // the arc taken to reach a token and the trace of the token it came from,
+    //  -1 for the start
+    struct Trace {
+        Arc arc;
+        int prev;
+    };
+
+    struct Token {
+        StateId state;
+        Weight weight;
+        int trace;
+    };
+
+    // the order of tokens, with the best first. Ties are broken by the
+    //  order in which the traces were made to keep the search deterministic
+    class TokenLess {
+    public:
+        bool operator()(const Token & a, const Token & b) const {
+            if(less_(a.weight, b.weight))
+                return true;
+            else if(less_(b.weight, a.weight))
+                return false;
+            return a.trace < b.trace;
+        }
+    private:
+        NaturalLess<Weight> less_;
+    };
+
+    // the order of the current min-heap, with the best on top
+    class TokenGreater {
+    public:
+        bool operator()(const Token & a, const Token & b) const { return less_(b, a); }
+    private:
+        TokenLess less_;
+    };
+
+    int addTrace(const Arc & arc, int prev) {
+        Trace trace;
+        trace.arc = arc;
+        trace.prev = prev;
+        traces_.push_back(trace);
+        return traces_.size() - 1;
+    }
+
+    // write the best path to the output as a string FST
+    void writeBestPath();
+
+    const Fst<Arc> & ifst_;
+    MutableFst<Arc> * ofst_;
+    unsigned beamWidth_;
+    BeamTrimCounts * counts_;
+    Weight threshold_;
+    // the backpointers of every token made
+    std::vector<Trace> traces_;
+    // the step in which each state was last expanded
+    StateTable<unsigned> expanded_;
+    // one more than the index in the next step of the token in each state,
+    //  and the step in which it was added
+    StateTable< std::pair<unsigned,unsigned> > bestNext_;
+    // the best complete path found so far
+    Weight bestFinal_;
+    StateId finalState_;
+    int finalTrace_;
+
+    ViterbiSearcher(const ViterbiSearcher<Arc> &);          // disallow
+    void operator=(const ViterbiSearcher<Arc> &);           // disallow
+
+};
+
+template <class Arc>
+void ViterbiSearcher<Arc>::search() {
+
+    NaturalLess<Weight> weightLess;
+    TokenLess tokenLess;
+    TokenGreater tokenGreater;
+    std::vector<Token> currHeap, nextTokens;
+    if(ifst_.Start() == kNoStateId)
+        return;
+
+    Token startToken;
+    startToken.state = ifst_.Start();
+    startToken.weight = Weight::One();
+    startToken.trace = -1;
+    currHeap.push_back(startToken);
+
+    unsigned step = 1;
+    while(currHeap.size() > 0) {
+
+        // the thresholds for this step and the next, which are zero (and
+        //  thus have no effect) when no threshold is set
+        Weight currBound = Times(currHeap.front().weight, threshold_);
+        Weight nextBound = Weight::Zero();
+        Weight bestNext = Weight::Zero();
+
+        while(currHeap.size() > 0) {
+
+            // pop the best token, stopping if it falls outside the threshold
+            //  and skipping states that a better token has expanded
+            Token currToken = currHeap.front();
+            std::pop_heap(currHeap.begin(), currHeap.end(), tokenGreater);
+            currHeap.pop_back();
+            if(!weightLess(currToken.weight, currBound))
+                break;
+            unsigned & expandStep = expanded_[expanded_.makeKey(currToken.state)];
+            if(expandStep == step) {
+                if(counts_)
+                    counts_->recombined++;
+                continue;
+            }
+            expandStep = step;
+
+            // remember the token if it finishes the best path so far
+            Weight finalWeight = Times(currToken.weight, ifst_.Final(currToken.state));
+            if(weightLess(finalWeight, bestFinal_)) {
+                bestFinal_ = finalWeight;
+                finalState_ = currToken.state;
+                finalTrace_ = currToken.trace;
+            }
+
+            // pass tokens along all the arcs in the state
+            for(ArcIterator< Fst<Arc> > ait(ifst_, currToken.state); !ait.Done(); ait.Next()) {
+                const Arc & arc = ait.Value();
+                Token nextToken;
+                nextToken.state = arc.nextstate;
+                nextToken.weight = Times(currToken.weight, arc.weight);
+                if(!weightLess(nextToken.weight, (arc.ilabel ? nextBound : currBound))) {
+                    if(counts_)
+                        counts_->pruned++;
+                    continue;
+                }
+                if(arc.ilabel) {
+                    // keep only the best token in each state of the next step,
+                    //  reusing the trace of the one it replaces
+                    std::pair<unsigned,unsigned> & best = bestNext_[bestNext_.makeKey(arc.nextstate)];
+                    if(best.second == step) {
+                        Token & other = nextTokens[best.first - 1];
+                        if(counts_)
+                            counts_->recombined++;
+                        if(!weightLess(nextToken.weight, other.weight))
+                            continue;
+                        other.weight = nextToken.weight;
+                        traces_[other.trace].arc = arc;
+                        traces_[other.trace].prev = currToken.trace;
+                        nextToken = other;
+                    } else {
+                        nextToken.trace = addTrace(arc, currToken.trace);
+                        nextTokens.push_back(nextToken);
+                        best = std::pair<unsigned,unsigned>(nextTokens.size(), step);
+                        if(counts_)
+                            counts_->inserted++;
+                    }
+                    // tighten the threshold when the best improves
+                    if(threshold_ != Weight::Zero() && weightLess(nextToken.weight, bestNext)) {
+                        bestNext = nextToken.weight;
+                        nextBound = Times(bestNext, threshold_);
+                    }
+                } else if(expanded_[expanded_.makeKey(arc.nextstate)] == step) {
+                    // a better token has already expanded the state
+                    if(counts_)
+                        counts_->recombined++;
+                } else {
+                    nextToken.trace = addTrace(arc, currToken.trace);
+                    currHeap.push_back(nextToken);
+                    std::push_heap(currHeap.begin(), currHeap.end(), tokenGreater);
+                    if(counts_)
+                        counts_->inserted++;
+                }
+            }
+
+        }
+
+        // keep the best tokens of the next step that are within the
+        //  threshold, which may have tightened after they were added
+        typename std::vector<Token>::iterator end = nextTokens.end();
+        if(threshold_ != Weight::Zero()) {
+            end = nextTokens.begin();
+            for(unsigned i = 0; i < nextTokens.size(); i++)
+                if(weightLess(nextTokens[i].weight, nextBound))
+                    *end++ = nextTokens[i];
+        }
+        if((unsigned)(end - nextTokens.begin()) > beamWidth_) {
+            std::nth_element(nextTokens.begin(), nextTokens.begin() + beamWidth_, end, tokenLess);
+            end = nextTokens.begin() + beamWidth_;
+        }
+        if(counts_)
+            counts_->pruned += nextTokens.end() - end;
+        currHeap.assign(nextTokens.begin(), end);
+        std::make_heap(currHeap.begin(), currHeap.end(), tokenGreater);
+        nextTokens.clear();
+
+        step++;
+        if(counts_)
+            counts_->steps++;
+
+    }
+
+    writeBestPath();
+
+}
+
+template <class Arc>
+void ViterbiSearcher<Arc>::writeBestPath() {
+    if(finalState_ == kNoStateId)
+        return;
+    std::vector<int> path;
+    for(int trace = finalTrace_; trace != -1; trace = traces_[trace].prev)
+        path.push_back(trace);
+    StateId state = ofst_->AddState();
+    ofst_->SetStart(state);
+    for(int i = path.size() - 1; i >= 0; i--) {
+        Arc arc = traces_[path[i]].arc;
+        arc.nextstate = ofst_->AddState();
+        ofst_->AddArc(state, arc);
+        state = arc.nextstate;
+    }
+    ofst_->SetFinal(state, ifst_.Final(finalState_));
+}
+
+// find the best path through an FST with a single pass of token-passing
+//  Viterbi search, aligning the number of non-epsilon input symbols as
+//  BeamTrim does. At most beamWidth tokens are kept at each step, and if
+//  a threshold is given, only those better than Times(best, threshold).
+//  The path is written to ofst as a string FST, which is left empty if no
+//  path is found.
+template <class Arc>
+void ViterbiSearch(const Fst<Arc> & ifst, MutableFst<Arc> * ofst, unsigned beamWidth,
+                   BeamTrimCounts * counts = 0,
+                   const typename Arc::Weight & threshold = Arc::Weight::Zero()) {
+    ViterbiSearcher<Arc> searcher(ifst, ofst, beamWidth, counts, threshold);
+    searcher.search();
+}
+
+}
+
+#endif // KYFD_VITERBI_SEARCH_H__
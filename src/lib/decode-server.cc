@@ -0,0 +1,151 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// decode-server.cc
+//
+//  Decoding for clients connected over a Unix domain socket
+
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <kyfd/decode-server.h>
+#include <kyfd/fd-stream.h>
+#include <kyfd/threads.h>
+
+using namespace std;
+using namespace kyfd;
+
+// the information passed to a client's thread
+struct ClientInfo {
+    DecodeServer * server;
+    int fd;
+};
+
+DecodeServer::DecodeServer(Decoder & decoder, const string & path) :
+    decoder_(decoder), path_(path), socket_(-1) {
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path_.length() >= sizeof(addr.sun_path))
+        throw runtime_error("Socket path '" + path_ + "' is too long");
+    strcpy(addr.sun_path, path_.c_str());
+
+    // remove any socket left over from a previous server, but never
+    //  anything else that was given by mistake
+    struct stat st;
+    if(lstat(path_.c_str(), &st) == 0) {
+        if(!S_ISSOCK(st.st_mode))
+            throw runtime_error("Cannot serve on '" + path_ + "' as it exists and is not a socket");
+        unlink(path_.c_str());
+    }
+    socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(socket_ < 0)
+        throw runtime_error("Could not create a socket");
+    if(bind(socket_, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(socket_, SOMAXCONN) < 0) {
+        ostringstream buff;
+        buff << "Could not listen on socket '" << path_ << "': " << strerror(errno);
+        close(socket_);
+        throw runtime_error(buff.str());
+    }
+
+    // clients that hang up should not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+}
+
+DecodeServer::~DecodeServer() {
+    if(socket_ >= 0) {
+        close(socket_);
+        unlink(path_.c_str());
+    }
+}
+
+void DecodeServer::serve() {
+    while(true) {
+        int fd = accept(socket_, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            throw runtime_error(string("Error accepting a client: ") + strerror(errno));
+        }
+        ClientInfo * info = new ClientInfo;
+        info->server = this;
+        info->fd = fd;
+        pthread_t thread;
+        try {
+            thread = StartThread(runClient, info);
+        } catch(std::exception & e) {
+            cerr << e.what() << endl;
+            close(fd);
+            delete info;
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+void* DecodeServer::runClient(void* ptr) {
+    ClientInfo * info = (ClientInfo*)ptr;
+    info->server->handleClient(info->fd);
+    close(info->fd);
+    delete info;
+    return NULL;
+}
+
+void DecodeServer::handleClient(int fd) {
+    FdStreamBuf buf(fd);
+    istream in(&buf);
+    ostream out(&buf);
+    try {
+        DecodeContext ctx(decoder_);
+        unsigned reload = decoder_.getConfig().getReload();
+        unsigned count = 0;
+        while(out) {
+            // read and decode a single sentence
+            ostringstream result;
+            try {
+                DecodeInput * input = decoder_.readInput(in);
+                if(input == NULL)
+                    break;
+                decoder_.decode(ctx, input, result);
+            } catch(std::exception & e) {
+                string message = e.what();
+                for(unsigned i = 0; i < message.length(); i++)
+                    if(message[i] == '\n')
+                        message[i] = ' ';
+                out << "ERROR " << message << endl;
+                continue;
+            }
+            // send the number of lines, then the lines themselves
+            string str = result.str();
+            unsigned lines = 0;
+            for(unsigned i = 0; i < str.length(); i++)
+                if(str[i] == '\n')
+                    lines++;
+            out << lines << "\n" << str << flush;
+            if(reload && ++count % reload == 0)
+                ctx.reset();
+        }
+    } catch(std::exception & e) {
+        cerr << "Error while serving a client: " << e.what() << endl;
+    }
+}
@@ -0,0 +1,137 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// decode-stats.cc
+//
+//  Timing statistics for decoding
+
+#include <cmath>
+#include <sstream>
+#include <kyfd/decode-stats.h>
+
+using namespace std;
+using namespace kyfd;
+
+// the lower bound of the first bucket in seconds
+static const double kMinLatency = 1e-7;
+
+void LatencyHistogram::add(double seconds) {
+    int bucket = 0;
+    if(seconds >= kMinLatency) {
+        bucket = 1 + (int)floor(log10(seconds / kMinLatency) * BUCKETS_PER_DECADE);
+        if(bucket >= NUM_BUCKETS)
+            bucket = NUM_BUCKETS - 1;
+    }
+    counts_[bucket]++;
+    count_++;
+}
+
+double LatencyHistogram::getQuantile(double q) const {
+    if(count_ == 0)
+        return 0;
+    unsigned long target = (unsigned long)ceil(q * count_);
+    if(target < 1)
+        target = 1;
+    unsigned long sum = 0;
+    int bucket;
+    for(bucket = 0; bucket < NUM_BUCKETS-1; bucket++) {
+        sum += counts_[bucket];
+        if(sum >= target)
+            break;
+    }
+    // return the geometric middle of the bucket
+    if(bucket == 0)
+        return kMinLatency;
+    return kMinLatency * pow(10.0, (bucket - 0.5) / BUCKETS_PER_DECADE);
+}
+
+void DecodeStats::add(const DecodeTimes & times) {
+    double wall = 0, cpu = 0;
+    for(int i = 0; i < NUM_STAGES; i++) {
+        DecodeStage stage = (DecodeStage)i;
+        stages_[i].add(times.getWall(stage), times.getCpu(stage));
+        wall += times.getWall(stage);
+        cpu += times.getCpu(stage);
+    }
+    if(compose_.size() < times.getNumModels())
+        compose_.resize(times.getNumModels());
+    for(unsigned i = 0; i < times.getNumModels(); i++) {
+        compose_[i].add(times.getComposeWall(i), times.getComposeCpu(i));
+        wall += times.getComposeWall(i);
+        cpu += times.getComposeCpu(i);
+    }
+    sentence_.add(wall, cpu);
+}
+
+const char* DecodeStats::getStageName(DecodeStage stage) {
+    switch(stage) {
+        case INPUT_STAGE: return "input";
+        case TRIM_STAGE: return "trim";
+        case DEDUP_STAGE: return "dedup";
+        case SEARCH_STAGE: return "search";
+        case OUTPUT_STAGE: return "output";
+        default: return "unknown";
+    }
+}
+
+// write the numbers for a single stage
+static void WriteStageJson(ostream & out, const string & name, const StageStats & stats) {
+    const LatencyHistogram & lat = stats.getLatency();
+    out << "{\"stage\": \"" << name << "\""
+        << ", \"count\": " << stats.getCount()
+        << ", \"wall\": " << stats.getWall()
+        << ", \"cpu\": " << stats.getCpu()
+        << ", \"p50\": " << lat.getQuantile(0.5)
+        << ", \"p90\": " << lat.getQuantile(0.9)
+        << ", \"p99\": " << lat.getQuantile(0.99) << "}";
+}
+
+void DecodeStats::writeJson(ostream & out) const {
+    out << "{\"sentences\": " << sentence_.getCount() << ", \"stages\": [";
+    WriteStageJson(out, "sentence", sentence_);
+    for(int i = 0; i < NUM_STAGES; i++) {
+        out << ", ";
+        WriteStageJson(out, getStageName((DecodeStage)i), stages_[i]);
+    }
+    for(unsigned i = 0; i < compose_.size(); i++) {
+        ostringstream name;
+        name << "compose" << i;
+        out << ", ";
+        WriteStageJson(out, name.str(), compose_[i]);
+    }
+    out << "]}" << endl;
+}
+
+// print a single stage
+static void PrintStage(ostream & out, const string & name, const StageStats & stats, double total) {
+    const LatencyHistogram & lat = stats.getLatency();
+    out << "Stage " << name << ": " << stats.getWall() << " sec wall, "
+        << stats.getCpu() << " sec cpu (" << (total > 0 ? stats.getWall()/total*100 : 0) << "%)"
+        << ", per sentence p50=" << lat.getQuantile(0.5)
+        << " p90=" << lat.getQuantile(0.9)
+        << " p99=" << lat.getQuantile(0.99) << endl;
+}
+
+void DecodeStats::print(ostream & out) const {
+    double total = sentence_.getWall();
+    PrintStage(out, "sentence", sentence_, total);
+    for(int i = 0; i < NUM_STAGES; i++)
+        PrintStage(out, getStageName((DecodeStage)i), stages_[i], total);
+    for(unsigned i = 0; i < compose_.size(); i++) {
+        ostringstream name;
+        name << "compose" << i;
+        PrintStage(out, name.str(), compose_[i], total);
+    }
+}
@@ -31,6 +31,9 @@ using namespace xercesc;
 using namespace fst;
 using namespace kyfd;
 
+// the largest fallback cache, about 2GB for each model with fallbacks
+static const int kMaxFallbackCache = 1 << 26;
+
 //////////////////
 // DecoderConfigImpl //
 //////////////////
@@ -39,8 +42,8 @@ using namespace kyfd;
 DecoderConfigImpl::DecoderConfigImpl() : 
     compRoots_(), stdRoots_(), iSymbols_(0), oSymbols_(0), n_(1),
     iUnkId_(-1), iBrId_(-1), oUnkId_(-1), oBrId_(-1), count_(1),
-    beamWidth_(0), trimWidth_(0), printDuplicates_(false), printInput_(false), 
-    printAll_(false), sample_(false), negProb_(false), staticSearch_(), reload_(0), 
+    beamWidth_(0), trimWidth_(0), beamThreshold_(0), recombine_(false), viterbi_(false), recoverComponents_(false), fallbackCache_(0), printDuplicates_(false), printInput_(false), 
+    printAll_(false), sample_(false), negProb_(false), staticSearch_(), reload_(0), threads_(1), pipeline_(false), queueSize_(1000), 
     inFormat_(TEXT_INPUT), outFormat_(TEXT_OUTPUT) {
     
     // set up xerces infrastructure
@@ -78,31 +81,6 @@ DecoderConfigImpl::~DecoderConfigImpl() {
     }
 }
 
-// populate a fallback map
-template <class LM>
-void PopulateMap(const char* fileName, LM & map) {
-    
-    ifstream instr(fileName);
-    if(!instr) {
-        ostringstream buff;
-        buff << "Fallback map file file '" << fileName << "' could not be found.";
-        throw runtime_error(buff.str());
-    }
-
-    // TODO: make this robust
-    int size = 1024;
-    char buff[size];
-    typename LM::key_type label1, label2;
-    while(instr.getline(buff, size)) {
-        istringstream iss(buff);
-        iss >> label1 >> label2;
-        map[label1] = label2;
-    }
-
-    instr.close();
-
-}
-
 // parse an FstNode
 template <class A>
 FstNode<A> * ParseNode(const DOMElement* elem, XercesStringManager &tags_) {
@@ -126,10 +104,17 @@ FstNode<A> * ParseNode(const DOMElement* elem, XercesStringManager &tags_) {
     // get the phi value
     DOMAttr* fallbackNode = elem->getAttributeNode(tags_.convert("fallback"));
     if(fallbackNode) {
-        LabelMap map;
         cerr << "Loading fallback file: " << tags_.convert(fallbackNode->getValue()) << endl;
-        PopulateMap<LabelMap>(tags_.convert(fallbackNode->getValue()), map);
-        ret->setFallbackMap( map );
+        ret->setFallbackMap( LabelMap::Read(tags_.convert(fallbackNode->getValue())) );
+    }
+
+    // get the number of arcs above which states are indexed
+    DOMAttr* indexNode = elem->getAttributeNode(tags_.convert("index"));
+    if(indexNode) {
+        int indexArcs = atoi(tags_.convert(indexNode->getValue()));
+        if(indexArcs < 0)
+            throw runtime_error( "The index attribute of an FST must not be negative" );
+        ret->setIndexArcs(indexArcs);
     }
     
     // if this is a plain FST get the file and read in
@@ -236,11 +221,19 @@ void DecoderConfig::handleArgument(const char* name, const char* val) {
         delete[] newVal;
     }
     else if(!strcmp(name, "output")) {
+        // the models are parsed in the forms that the output needs
+        if(impl_->compRoots_.size() || impl_->stdRoots_.size())
+            throw runtime_error( "The output argument must be given before the models" );
         if(!strcmp(val, "text")) impl_->outFormat_ = TEXT_OUTPUT;
         else if(!strcmp(val, "score")) impl_->outFormat_ = SCORE_OUTPUT;
         else if(!strcmp(val, "component")) impl_->outFormat_ = COMPONENT_OUTPUT;
         else throw runtime_error( "Bad output format specified" );
     }
+    else if(!strcmp(name, "recovercomponents")) {
+        if(impl_->compRoots_.size() || impl_->stdRoots_.size())
+            throw runtime_error( "The recovercomponents argument must be given before the models" );
+        setRecoverComponents(!strcmp(val, "true"));
+    }
     else if(!strcmp(name, "input")) {
         if(!strcmp(val, "text")) impl_->inFormat_ = TEXT_INPUT;
         else if(!strcmp(val, "std")) impl_->inFormat_ = STD_INPUT;
@@ -267,12 +260,53 @@ void DecoderConfig::handleArgument(const char* name, const char* val) {
         setBeamWidth(atoi(val));
     }
     else if(!strcmp(name, "trim")) {
-        if(getBeamWidth() != 0)
+        if(getBeamWidth() != 0 || getBeamThreshold() != 0)
             throw runtime_error( "Cannot set both a beam width and trimming width" );
+        if(isViterbi())
+            throw runtime_error( "Cannot set both Viterbi search and a trimming width" );
         setTrimWidth(atof(val));
     }
+    else if(!strcmp(name, "beamthreshold")) {
+        if(getTrimWidth() != 0.0)
+            throw runtime_error( "Cannot set both a beam threshold and trimming width" );
+        if(atof(val) < 0)
+            throw runtime_error( "The beam threshold must not be negative" );
+        setBeamThreshold(atof(val));
+    }
+    else if(!strcmp(name, "recombine"))
+        setRecombine(!strcmp(val, "true"));
+    else if(!strcmp(name, "viterbi")) {
+        if(getTrimWidth() != 0.0)
+            throw runtime_error( "Cannot set both Viterbi search and a trimming width" );
+        setViterbi(!strcmp(val, "true"));
+    }
+    else if(!strcmp(name, "fallbackcache")) {
+        if(atoi(val) < 0 || atoi(val) > kMaxFallbackCache)
+            throw runtime_error( "The fallback cache size must be between 0 and 67108864" );
+        setFallbackCache(atoi(val));
+    }
     else if(!strcmp(name, "reload"))
         setReload(atoi(val));
+    else if(!strcmp(name, "threads")) {
+        if(atoi(val) < 1)
+            throw runtime_error( "The number of threads must be at least 1" );
+        setThreads(atoi(val));
+    }
+    else if(!strcmp(name, "pipeline"))
+        setPipeline(!strcmp(val, "true"));
+    else if(!strcmp(name, "queuesize")) {
+        if(atoi(val) < 1)
+            throw runtime_error( "The queue size must be at least 1" );
+        setQueueSize(atoi(val));
+    }
+    else if(!strcmp(name, "serve"))
+        setServe(val);
+    else if(!strcmp(name, "stats"))
+        setStats(val);
+    else if(!strcmp(name, "searchstats"))
+        setSearchStats(val);
+    else if(!strcmp(name, "cachedir"))
+        setCacheDir(val);
     else {
         ostringstream buff;
         buff << "Bad argument " << name;
@@ -324,10 +358,11 @@ void DecoderConfig::parseConfigFile(const char* fileName) {
         }
         // handle the fst function
         else if(!strcmp(name, "fst")) {
-            // load in component format if we need to track individual values, std format if not
+            // load in component format if we need to track individual values, std format if not,
+            //  or both if the components are recovered after searching in std format
             if(impl_->outFormat_ == COMPONENT_OUTPUT)
                 impl_->compRoots_.push_back( ParseNode<ComponentArc>(node, impl_->tags_) );
-            else
+            if(impl_->outFormat_ != COMPONENT_OUTPUT || impl_->recoverComponents_)
                 impl_->stdRoots_.push_back( ParseNode<StdArc>(node, impl_->tags_) );
         }
         else {
@@ -336,6 +371,9 @@ void DecoderConfig::parseConfigFile(const char* fileName) {
             throw runtime_error(buff.str());
         }
     }
+
+    // weights may be specified before or after the models
+    applyWeights();
  
 }
 
@@ -382,7 +420,8 @@ void DecoderConfig::parseCommandLine(int argc, char** argv) {
         else if(i != argc-1) {
             if(*argv[i] != '-')
                 throw runtime_error( "Invalid command line input" );
-            handleArgument(argv[i]+1, argv[i+1]);
+            // allow both -name and --name
+            handleArgument(argv[i]+(argv[i][1] == '-' ? 2 : 1), argv[i+1]);
         }
     }
 
@@ -390,18 +429,29 @@ void DecoderConfig::parseCommandLine(int argc, char** argv) {
 
 }
 
-// build the models
-const FstNode<ComponentArc> * DecoderConfig::getComponentNode(unsigned id) {
+// set the weights and pass them on to the models
+void DecoderConfig::setWeights(const Weights & weights) {
+    impl_->weights_ = weights;
+    applyWeights();
+}
+
+void DecoderConfig::applyWeights() {
+    if(impl_->weights_.size() == 0)
+        return;
+    for(unsigned i = 0; i < impl_->compRoots_.size(); i++)
+        impl_->compRoots_[i]->adjustWeights(impl_->weights_);
+    for(unsigned i = 0; i < impl_->stdRoots_.size(); i++)
+        impl_->stdRoots_[i]->adjustWeights(impl_->weights_);
+}
+
+// get the model nodes
+const FstNode<ComponentArc> * DecoderConfig::getComponentNode(unsigned id) const {
     if(id >= impl_->compRoots_.size())
         throw runtime_error( "Attempt to get a component node larger than exists" );
-    if(impl_->weights_.size() > 0)
-        impl_->compRoots_[id]->adjustWeights(impl_->weights_);
     return impl_->compRoots_[id];
 }
-const FstNode<StdArc> * DecoderConfig::getStdNode(unsigned id) {
+const FstNode<StdArc> * DecoderConfig::getStdNode(unsigned id) const {
     if(id >= impl_->stdRoots_.size())
         throw runtime_error( "Attempt to get a stdonent node larger than exists" );
-    if(impl_->weights_.size() > 0)
-        impl_->stdRoots_[id]->adjustWeights(impl_->weights_);
     return impl_->stdRoots_[id];
 }
@@ -17,13 +17,16 @@
 //
 //  The main body of the decoder code
 
+#include <climits>
 #include <fst/rmepsilon.h>
 #include <fst/vector-fst.h>
 #include <fst/shortest-path.h>
 #include <fst/project.h>
 #include <fst/compose.h>
 #include <kyfd/decoder.h>
+#include <kyfd/context-fst.h>
 #include <kyfd/beam-trim.h>
+#include <kyfd/viterbi-search.h>
 #include <kyfd/sampgen.h>
 
 using namespace std;
@@ -31,117 +34,313 @@ using namespace fst;
 using namespace kyfd;
 
 
-Decoder::Decoder(const DecoderConfig & config) : 
-    sentenceId_(0), compModels_(), stdModels_(), compFallbacks_(), stdFallbacks_(), config_(config) {
-
-    // initialize the time values
-    int NUM_TIMES = 9;
-    currTime_.push_back(0);
-    for(int i = 0; i < NUM_TIMES; i++) {
-        currTime_.push_back(0);
-        timeSpent_.push_back(0);
+// make the views of a set of models used by a single context
+template <class A>
+void CopyModels(const vector< Fst<A>* > & models, vector< Fst<A>* > & views, vector< Fst<A>* > & copies) {
+    for(unsigned i = 0; i < models.size(); i++) {
+        // fully expanded models can be read by any number of threads, but
+        //  lazy models need their own cache
+        if(models[i]->Properties(kExpanded, false)) {
+            copies.push_back(0);
+            views.push_back(new ContextFst<A>(*models[i], true));
+        } else {
+            copies.push_back(models[i]->Copy(true));
+            views.push_back(new ContextFst<A>(*copies[i], false));
+        }
     }
-    
+}
+
+template <class A>
+void ClearModels(vector< Fst<A>* > & views, vector< Fst<A>* > & copies) {
+    for(unsigned i = 0; i < views.size(); i++)
+        delete views[i];
+    for(unsigned i = 0; i < copies.size(); i++)
+        delete copies[i];
+    views.clear();
+    copies.clear();
+}
+
+DecodeContext::DecodeContext(const Decoder & decoder) : 
+    decoder_(decoder), sentenceId_(0), compModels_(), compCopies_(), 
+    stdModels_(), stdCopies_() {
+
+    reset();
+
+}
+
+void DecodeContext::reset() {
+    clearModels();
+    ThreadLock lock(decoder_.modelMutex_);
+    CopyModels(decoder_.compModels_, compModels_, compCopies_);
+    CopyModels(decoder_.stdModels_, stdModels_, stdCopies_);
+}
+
+void DecodeContext::clearModels() {
+    ThreadLock lock(decoder_.modelMutex_);
+    ClearModels(compModels_, compCopies_);
+    ClearModels(stdModels_, stdCopies_);
+}
+
+Decoder::Decoder(const DecoderConfig & config) : 
+    compModels_(), stdModels_(), compFallbacks_(), stdFallbacks_(), compFallbackCaches_(), stdFallbackCaches_(), compIndexes_(), stdIndexes_(), config_(config), searchStatsFile_(0), context_(0) {
+
     // get whether or not to reverse the sign
     multiplier_ = ( config_.isNegativeProbabilities() ? -1 : 1 );
 
-    buildModels();
+    // open the statistics file first, as the models are not deleted if the
+    //  constructor throws
+    if(config_.getSearchStats().length() > 0) {
+        searchStatsFile_ = new ofstream(config_.getSearchStats().c_str());
+        if(!*searchStatsFile_) {
+            delete searchStatsFile_;
+            throw runtime_error("Could not open search statistics file '"+config_.getSearchStats()+"'");
+        }
+    }
+
+    try {
+        buildModels();
+    } catch(...) {
+        delete searchStatsFile_;
+        throw;
+    }
+
+    context_ = new DecodeContext(*this);
 
 }
 
 void Decoder::buildModels() {
-    // load the model
+    // the models and their subtrees are built in parallel, using the same
+    //  number of threads as decoding
+    ThreadBudget budget(config_.getThreads() - 1);
+    // load the model, in both forms if components are recovered after
+    //  searching over standard arcs
     if(config_.getOutputFormat() == COMPONENT_OUTPUT) {
         for(unsigned i = 0; i < compModels_.size(); i++)
             delete compModels_[i];
         compFallbacks_.clear();
+        ClearFallbackCaches(compFallbackCaches_);
+        ClearLabelIndexes(compIndexes_);
         compModels_.clear();
+        vector< const FstNode<ComponentArc>* > nodes;
+        for(unsigned i = 0; i < config_.getNumModels(); i++)
+            nodes.push_back(config_.getComponentNode(i));
+        BuildFstNodes(nodes, config_.getCacheDir(), &budget, compModels_);
         for(unsigned i = 0; i < config_.getNumModels(); i++) {
-            const FstNode<ComponentArc> * myNode = config_.getComponentNode(i);
-            compModels_.push_back(myNode->buildFst());
-            compFallbacks_.push_back(myNode->getFallbackMap());
+            compFallbacks_.push_back(nodes[i]->getFallbackMap());
+            compFallbackCaches_.push_back(makeFallbackCache(*compModels_[i], compFallbacks_[i]));
+            compIndexes_.push_back(FstNode<ComponentArc>::makeLabelIndex(*compModels_[i], nodes[i]->getIndexArcs(), nodes[i]->getName()));
+            // test the properties checked by the matchers now, as contexts
+            //  sharing an expanded model will not test them
+            if(compModels_[i]->Properties(kExpanded, false))
+                compModels_[i]->Properties(kAcceptor | kILabelSorted, true);
         }
     }
-    else {
+    if(isStdSearch()) {
         for(unsigned i = 0; i < stdModels_.size(); i++)
             delete stdModels_[i];
         stdFallbacks_.clear();
+        ClearFallbackCaches(stdFallbackCaches_);
+        ClearLabelIndexes(stdIndexes_);
         stdModels_.clear();
+        vector< const FstNode<StdArc>* > nodes;
+        for(unsigned i = 0; i < config_.getNumModels(); i++)
+            nodes.push_back(config_.getStdNode(i));
+        BuildFstNodes(nodes, config_.getCacheDir(), &budget, stdModels_);
         for(unsigned i = 0; i < config_.getNumModels(); i++) {
-            const FstNode<StdArc> * myNode = config_.getStdNode(i);
-            stdModels_.push_back(myNode->buildFst());
-            stdFallbacks_.push_back(myNode->getFallbackMap());
+            stdFallbacks_.push_back(nodes[i]->getFallbackMap());
+            stdFallbackCaches_.push_back(makeFallbackCache(*stdModels_[i], stdFallbacks_[i]));
+            stdIndexes_.push_back(FstNode<StdArc>::makeLabelIndex(*stdModels_[i], nodes[i]->getIndexArcs(), nodes[i]->getName()));
+            if(stdModels_[i]->Properties(kExpanded, false))
+                stdModels_[i]->Properties(kAcceptor | kILabelSorted, true);
         }
     }
+    if(context_)
+        context_->reset();
 }
 
-bool Decoder::decode(istream& in, ostream& out) {
-    timeStep_ = 0;
-    currTime_[timeStep_++] = clock();
-
-    if(config_.getOutputFormat() == COMPONENT_OUTPUT)
-        return process<ComponentArc, ComponentWeight, CompLabelMap>(compModels_, compFallbacks_, in, out);
-    else
-        return process<StdArc, TropicalWeight, StdLabelMap>(stdModels_, stdFallbacks_, in, out);
+template <class A, class LM>
+FallbackCache<A> * Decoder::makeFallbackCache(const Fst<A> & model, const LM * fallbacks) const {
+    // the states of lazy models are numbered separately in each context, so
+    //  only expanded ones can share a cache
+    if(fallbacks == 0 || config_.getFallbackCache() == 0 || !model.Properties(kExpanded, false))
+        return 0;
+    return new FallbackCache<A>(config_.getFallbackCache());
 }
 
-template <class A, class W, class LM>
-bool Decoder::process(const vector< Fst<A>* > & models,
-                        const std::vector< const LM* > & fallbacks,
-                        istream & in, ostream & out) {
-    currTime_[timeStep_++] = clock();
-    Fst<A> * input = makeFst<A>(in);
+bool Decoder::decode(DecodeContext & ctx, istream& in, ostream& out) const {
+    DecodeInput * input = readInput(in);
     if(input == NULL)
         return false;
-    currTime_[timeStep_++] = clock();
-    Fst<A> * best = findBestPaths<A>(input, models, fallbacks);
-    currTime_[timeStep_++] = clock();
-    // if nothing could be found, print the input
-    bool hasAnswer = best->Start() != kNoStateId;
-    if(!hasAnswer) {
-        // printPaths<A,W>(*input,"WARNING, no path found for: ",cerr);
-        cerr  << "WARNING, no path found" << endl;
-        Fst<A> * swapPtr = input; input = best; best = swapPtr;
+    return decode(ctx, input, out);
+}
+
+bool Decoder::decode(DecodeContext & ctx, const Strings & tokens, ostream& out) const {
+    return decode(ctx, readInput(tokens), out);
+}
+
+bool Decoder::decode(DecodeContext & ctx, DecodeInput * input, ostream& out) const {
+    input->setId(ctx.sentenceId_++);
+    DecodeResult * result = search(ctx, input);
+    try {
+        printResult(*result, out);
+    } catch(...) {
+        delete result;
+        throw;
+    }
+    delete result;
+    return true;
+}
+
+DecodeInput * Decoder::readInput(istream& in) const {
+    DecodeInput * input = new DecodeInput;
+    StageTimer timer;
+    if(!isStdSearch())
+        input->compFst_ = makeFst<ComponentArc>(input->unknowns_, in);
+    else
+        input->stdFst_ = makeFst<StdArc>(input->unknowns_, in);
+    if(input->compFst_ == NULL && input->stdFst_ == NULL) {
+        delete input;
+        return NULL;
+    }
+    input->times_.lap(INPUT_STAGE, timer);
+    return input;
+}
+
+DecodeInput * Decoder::readInput(const Strings & tokens) const {
+    DecodeInput * input = new DecodeInput;
+    StageTimer timer;
+    if(!isStdSearch())
+        input->compFst_ = makeFst<ComponentArc>(input->unknowns_, tokens);
+    else
+        input->stdFst_ = makeFst<StdArc>(input->unknowns_, tokens);
+    input->times_.lap(INPUT_STAGE, timer);
+    return input;
+}
+
+DecodeResult * Decoder::search(DecodeContext & ctx, DecodeInput * input) const {
+    DecodeResult * result = new DecodeResult;
+    result->id_ = input->id_;
+    result->unknowns_.swap(input->unknowns_);
+    result->times_ = input->times_;
+    SearchStats * searchStats = (searchStatsFile_ ? &result->searchStats_ : 0);
+    // the input is owned from here on, so it is deleted even if the search
+    //  fails
+    try {
+        if(!isStdSearch()) {
+            result->compFst_ = process<ComponentArc, CompLabelMap>(ctx, ctx.compModels_, compFallbacks_, compFallbackCaches_, compIndexes_, input->compFst_, result->bothInput_, result->times_, searchStats);
+            input->compFst_ = 0;
+        } else if(config_.getOutputFormat() != COMPONENT_OUTPUT) {
+            result->stdFst_ = process<StdArc, StdLabelMap>(ctx, ctx.stdModels_, stdFallbacks_, stdFallbackCaches_, stdIndexes_, input->stdFst_, result->bothInput_, result->times_, searchStats);
+            input->stdFst_ = 0;
+        } else {
+            // keep the input with component weights, given to the first
+            //  component as parseWeight does, to recover the components with
+            const DecoderConfig::Weights & weights = config_.getWeights();
+            VectorFst<ComponentArc> * compInput = new VectorFst<ComponentArc>;
+            Map(*input->stdFst_, compInput, WeightedComponentMapper(0, (weights.size() ? weights[0] : 1)));
+            Fst<StdArc> * stdBest = 0;
+            try {
+                stdBest = process<StdArc, StdLabelMap>(ctx, ctx.stdModels_, stdFallbacks_, stdFallbackCaches_, stdIndexes_, input->stdFst_, result->bothInput_, result->times_, searchStats);
+                input->stdFst_ = 0;
+                StageTimer timer;
+                if(result->bothInput_)
+                    result->compFst_ = compInput;
+                else
+                    result->compFst_ = recoverComponents(ctx, *compInput, *stdBest);
+                result->times_.lap(SEARCH_STAGE, timer);
+            } catch(...) {
+                delete compInput;
+                delete stdBest;
+                throw;
+            }
+            if(!result->bothInput_)
+                delete compInput;
+            delete stdBest;
+        }
+    } catch(...) {
+        delete input;
+        delete result;
+        throw;
     }
+    delete input;
+    return result;
+}
+
+void Decoder::printResult(const DecodeResult & result, ostream& out) const {
     ostringstream buff;
     if(config_.getN() > 1)
-        buff << sentenceId_ << "|||"; 
+        buff << result.id_ << "|||"; 
     string str = buff.str();
-    W weight = W::One();
-    printPaths<A,W>(*best, str, out, !hasAnswer);
-    currTime_[timeStep_++] = clock();
-    if(input != best)
+    StageTimer timer;
+    if(config_.getOutputFormat() == COMPONENT_OUTPUT)
+        printPaths<ComponentArc, ComponentWeight>(result.unknowns_, *result.compFst_, str, out, result.bothInput_);
+    else
+        printPaths<StdArc, TropicalWeight>(result.unknowns_, *result.stdFst_, str, out, result.bothInput_);
+    DecodeTimes times = result.times_;
+    times.lap(OUTPUT_STAGE, timer);
+    ThreadLock lock(statsMutex_);
+    stats_.add(times);
+    if(searchStatsFile_)
+        result.searchStats_.writeJson(*searchStatsFile_, result.id_);
+}
+
+bool Decoder::readSentence(istream& in, string & sentence) const {
+    string line;
+    sentence.clear();
+    // flat input
+    if(config_.getInputFormat() == TEXT_INPUT) {
+        if(!getline(in, line))
+            return false;
+        sentence = line + "\n";
+        return true;
+    }
+    // fst input, terminated by an empty line
+    while(getline(in, line) && line.length() > 0)
+        sentence += line + "\n";
+    return sentence.length() > 0;
+}
+
+template <class A, class LM>
+Fst<A> * Decoder::process(DecodeContext & ctx,
+                        const vector< Fst<A>* > & models,
+                        const std::vector< const LM* > & fallbacks,
+                        const std::vector< FallbackCache<A>* > & caches,
+                        const std::vector< LabelIndex<A>* > & indexes,
+                        Fst<A> * input, bool & bothInput,
+                        DecodeTimes & times, SearchStats * searchStats) const {
+    Fst<A> * best = findBestPaths<A>(ctx, input, models, fallbacks, caches, indexes, times, searchStats);
+    // if nothing could be found, print the input
+    bothInput = best->Start() == kNoStateId;
+    if(bothInput) {
+        cerr  << "WARNING, no path found" << endl;
+        delete best;
+        best = input;
+    } else 
         delete input;
-    delete best;
-    currTime_[timeStep_++] = clock();
-    for(unsigned i = 0; i < currTime_.size()-1; i++)
-        timeSpent_[i] += (currTime_[i+1]-currTime_[i]);
-    sentenceId_++;
-    return true;
+    return best;
 }
 
-const string & Decoder::getWeightString(const ComponentWeight & weight) {
+string Decoder::getWeightString(const ComponentWeight & weight) const {
     ostringstream buff;
     for(unsigned short i = 1; i < weight.getWidth(); i++)
         buff << (weight.getComponent(i) * multiplier_) << " ";
     buff << "||| " << (weight.Value() * multiplier_);
-    str_ = buff.str();
-    return str_;
+    return buff.str();
 }
 
-const string & Decoder::getWeightString(const TropicalWeight & weight) {
+string Decoder::getWeightString(const TropicalWeight & weight) const {
     ostringstream buff;
     buff << (weight.Value() * multiplier_);
-    str_ = buff.str();
-    return str_;
+    return buff.str();
 }
 
 template <class A, class W>
 void Decoder::printPaths(
+    const Strings & unknowns,
     const Fst<A> &bestFst,
     const string &header,
     ostream & resultStream,
-    bool bothInput) {
+    bool bothInput) const {
     
     // loop through all the paths
     for(ArcIterator< Fst<A> > aiter(bestFst, bestFst.Start()); !aiter.Done(); aiter.Next()) {
@@ -162,12 +361,12 @@ void Decoder::printPaths(
                     if(printed)
                         resultStream << " ";
 	            	if(arc.ilabel==config_.getInputUnknownId())
-                        resultStream << unknowns_[iUnkId++];
+                        resultStream << unknowns[iUnkId++];
 	            	else 
                         resultStream << config_.getInputSymbol(arc.ilabel);
                     resultStream << "|";
 	            	if(arc.olabel==config_.getOutputUnknownId())
-                        resultStream << unknowns_[oUnkId++];
+                        resultStream << unknowns[oUnkId++];
 	            	else 
                         resultStream << config_.getOutputSymbol(arc.olabel);
                     printed = true;
@@ -176,7 +375,7 @@ void Decoder::printPaths(
                 // print the input
 	            if(config_.isPrintInput() && arc.ilabel != 0 && arc.ilabel != config_.getInputTerminalId()) {
 	            	if(arc.ilabel==config_.getInputUnknownId())
-                        input << " " << unknowns_[iUnkId++];
+                        input << " " << unknowns[iUnkId++];
 	            	else 
                         input << " " << config_.getInputSymbol(arc.ilabel);
 	            }
@@ -185,9 +384,9 @@ void Decoder::printPaths(
                     if(printed)
                         resultStream << " ";
 	            	if(arc.olabel==(bothInput?config_.getInputUnknownId():config_.getOutputUnknownId())) {
-                        if(oUnkId < 0 || oUnkId >= unknowns_.size())
+                        if(oUnkId < 0 || oUnkId >= unknowns.size())
                             throw runtime_error("Unmatched number of unknown symbols in output");
-                        resultStream << unknowns_[oUnkId++];
+                        resultStream << unknowns[oUnkId++];
                     }
 	            	else 
                         resultStream << (bothInput?config_.getInputSymbol(arc.olabel):config_.getOutputSymbol(arc.olabel));
@@ -212,48 +411,188 @@ void Decoder::printPaths(
 
 }
 
-// compose and get the best paths
 template <class A, class LM>
-fst::Fst<A> * Decoder::findBestPaths(const fst::Fst<A> * input, 
+fst::Fst<A> * Decoder::composeModels(fst::Fst<A> * searchFst,
                                      const std::vector< fst::Fst<A> * > & models,
-                                     const std::vector< const LM* > & fallbacks) {
-    
-    typedef fst::FallbackMatcher< fst::Matcher<fst::Fst<A> > > FB;
-
-    currTime_[timeStep_++] = clock();
+                                     const std::vector< const LM* > & fallbacks,
+                                     const std::vector< FallbackCache<A>* > & caches,
+                                     const std::vector< LabelIndex<A>* > & indexes,
+                                     bool allowStatic,
+                                     DecodeTimes * times,
+                                     SearchStats * searchStats) const {
+
+    typedef fst::IndexedMatcher< fst::Fst<A> > IM;
+    typedef fst::FallbackMatcher<IM> FB;
+
+    // composition is lazy unless static search is used, so most of its cost
+    //  is counted in the stages that expand the composed FST
+    StageTimer timer;
+    if(searchStats)
+        searchStats->getCompose().resize(models.size());
     
     // compose the models in order
-    Fst<A> * searchFst = new VectorFst<A>(*input);
     for(unsigned i = 0; i < models.size(); i++) {
-        fst::ComposeFstOptions<A, FB> copts(CacheOptions(),
-                      new FB(*searchFst, ( fallbacks[i] == 0 ? fst::MATCH_OUTPUT : fst::MATCH_NONE ) ),
-                      new FB(*models[i], fst::MATCH_INPUT, fallbacks[i]));
+        FB * searchMatcher = new FB(*searchFst, ( fallbacks[i] == 0 ? fst::MATCH_OUTPUT : fst::MATCH_NONE ) );
+        FB * modelMatcher = new FB(*models[i], fst::MATCH_INPUT, fallbacks[i], true, false,
+                                   new IM(*models[i], fst::MATCH_INPUT, indexes[i]));
+        if(caches[i])
+            modelMatcher->SetCache(caches[i]);
+        if(searchStats) {
+            searchMatcher->SetCounts(&searchStats->getCompose()[i]);
+            modelMatcher->SetCounts(&searchStats->getCompose()[i]);
+        }
+        fst::ComposeFstOptions<A, FB> copts(CacheOptions(), searchMatcher, modelMatcher);
         Fst<A> * nextFst = new ComposeFst<A>(*searchFst, *models[i], copts);
         delete searchFst;
-        if(nextFst->Start() == kNoStateId)
+        if(nextFst->Start() == kNoStateId) {
+            if(times)
+                times->lapCompose(i, timer);
             return nextFst;
-        if(config_.isStaticSearch(i)) {
+        }
+        if(allowStatic && config_.isStaticSearch(i)) {
             VectorFst<A> * vecFst = new VectorFst<A>(*nextFst);
             delete nextFst;
             Connect(vecFst);
             nextFst = vecFst;
         }
         searchFst = nextFst;
+        if(times)
+            times->lapCompose(i, timer);
+    }
+    return searchFst;
+
+}
+
+fst::Fst<ComponentArc> * Decoder::recoverComponents(DecodeContext & ctx,
+                                                   const fst::Fst<ComponentArc> & input,
+                                                   const fst::Fst<StdArc> & bestFst) const {
+
+    // the composition of the models is shared between the paths, so states
+    //  expanded for one path are reused by the next
+    Fst<ComponentArc> * modelFst = composeModels<ComponentArc, CompLabelMap>(input.Copy(), ctx.compModels_, compFallbacks_, compFallbackCaches_, compIndexes_, false, 0, 0);
+    VectorFst<ComponentArc> * ret = new VectorFst<ComponentArc>;
+    ret->SetStart(ret->AddState());
+    // paths that cannot be recovered keep their standard score
+    WeightedComponentMapper stdMapper(ComponentWeight::BAD_INDEX, 1);
+
+    for(ArcIterator< Fst<StdArc> > aiter(bestFst, bestFst.Start()); !aiter.Done(); aiter.Next()) {
+
+        // make an acceptor for the output of the path, and a copy of the
+        //  path itself with only its standard score
+        VectorFst<ComponentArc> * outputFst = new VectorFst<ComponentArc>;
+        ComponentArc::StateId outputState = outputFst->AddState();
+        outputFst->SetStart(outputState);
+        VectorFst<ComponentArc> stdPath;
+        ComponentArc::StateId stdState = stdPath.AddState();
+        stdPath.SetStart(stdState);
+        StdArc arc = aiter.Value();
+        while(true) {
+            if(arc.olabel != 0) {
+                ComponentArc::StateId nextState = outputFst->AddState();
+                outputFst->AddArc(outputState, ComponentArc(arc.olabel, arc.olabel, ComponentWeight::One(), nextState));
+                outputState = nextState;
+            }
+            ComponentArc stdArc = stdMapper(arc);
+            stdArc.nextstate = stdPath.AddState();
+            stdPath.AddArc(stdState, stdArc);
+            stdState = stdArc.nextstate;
+            ArcIterator< Fst<StdArc> > aiter2(bestFst, arc.nextstate);
+            if(aiter2.Done())
+                break;
+            arc = aiter2.Value();
+        }
+        outputFst->SetFinal(outputState, ComponentWeight::One());
+        stdPath.SetFinal(stdState, stdMapper(StdArc(0, 0, bestFst.Final(arc.nextstate), kNoStateId)).weight);
+
+        // find the best path through the models with this output, and add it
+        //  to the paths to print
+        vector< Fst<ComponentArc>* > outputModels(1, outputFst);
+        vector< const CompLabelMap* > outputFallbacks(1, (const CompLabelMap*)0);
+        vector< FallbackCache<ComponentArc>* > outputCaches(1, (FallbackCache<ComponentArc>*)0);
+        vector< LabelIndex<ComponentArc>* > outputIndexes(1, (LabelIndex<ComponentArc>*)0);
+        VectorFst<ComponentArc> bestPath;
+        if(modelFst->Start() != kNoStateId) {
+            Fst<ComponentArc> * pathFst = composeModels<ComponentArc, CompLabelMap>(modelFst->Copy(), outputModels, outputFallbacks, outputCaches, outputIndexes, false, 0, 0);
+            if(pathFst->Start() != kNoStateId)
+                ShortestPath(*pathFst, &bestPath, 1);
+            delete pathFst;
+        }
+        delete outputFst;
+        if(bestPath.Start() == kNoStateId) {
+            cerr << "WARNING, could not recover the components of a path, printing its standard score" << endl;
+            bestPath = stdPath;
+        }
+        vector<ComponentArc::StateId> stateMap(bestPath.NumStates(), kNoStateId);
+        stateMap[bestPath.Start()] = ret->Start();
+        for(StateIterator< VectorFst<ComponentArc> > siter(bestPath); !siter.Done(); siter.Next())
+            if(stateMap[siter.Value()] == kNoStateId)
+                stateMap[siter.Value()] = ret->AddState();
+        for(StateIterator< VectorFst<ComponentArc> > siter(bestPath); !siter.Done(); siter.Next()) {
+            ComponentArc::StateId state = siter.Value();
+            for(ArcIterator< VectorFst<ComponentArc> > pathIter(bestPath, state); !pathIter.Done(); pathIter.Next()) {
+                ComponentArc pathArc = pathIter.Value();
+                pathArc.nextstate = stateMap[pathArc.nextstate];
+                ret->AddArc(stateMap[state], pathArc);
+            }
+            if(bestPath.Final(state) != ComponentWeight::Zero())
+                ret->SetFinal(stateMap[state], bestPath.Final(state));
+        }
+
+    }
+
+    delete modelFst;
+    return ret;
+
+}
+
+// compose and get the best paths
+template <class A, class LM>
+fst::Fst<A> * Decoder::findBestPaths(DecodeContext & ctx,
+                                     const fst::Fst<A> * input, 
+                                     const std::vector< fst::Fst<A> * > & models,
+                                     const std::vector< const LM* > & fallbacks,
+                                     const std::vector< FallbackCache<A>* > & caches,
+                                     const std::vector< LabelIndex<A>* > & indexes,
+                                     DecodeTimes & times,
+                                     SearchStats * searchStats) const {
+
+    Fst<A> * searchFst = composeModels<A, LM>(new VectorFst<A>(*input), models, fallbacks, caches, indexes, true, &times, searchStats);
+    if(searchFst->Start() == kNoStateId)
+        return searchFst;
+    StageTimer timer;
+
+    unsigned beamWidth = ( config_.getBeamWidth() ? config_.getBeamWidth() : UINT_MAX );
+    typename A::Weight threshold = ( config_.getBeamThreshold() ? typename A::Weight(config_.getBeamThreshold()) : A::Weight::Zero() );
+
+    // for the single best path, search the composed FST directly without
+    //  trimming it first. the beam is applied during the search and a single
+    //  path has no duplicates, so the trim and dedup stages take no time
+    if(config_.isViterbi() && config_.getN() == 1 && !config_.isSample()) {
+        times.lap(TRIM_STAGE, timer);
+        times.lap(DEDUP_STAGE, timer);
+        VectorFst<A> * bestFst = new VectorFst<A>;
+        ViterbiSearch(*searchFst, bestFst, beamWidth, 
+                      (searchStats ? &searchStats->getTrim() : 0), threshold);
+        delete searchFst;
+        times.lap(SEARCH_STAGE, timer);
+        if(searchStats)
+            searchStats->countResult(*bestFst);
+        return bestFst;
     }
 
-    currTime_[timeStep_++] = clock();
     // trim down the FST if necessary
-    if(config_.getBeamWidth() + config_.getTrimWidth() > 0) {
+    if(config_.getBeamWidth() + config_.getTrimWidth() + config_.getBeamThreshold() > 0) {
         VectorFst<A> * trimFst = new VectorFst<A>;
-        if(config_.getBeamWidth())
-            BeamTrim(*searchFst, trimFst, config_.getBeamWidth());
-        else
+        if(config_.getBeamWidth() || config_.getBeamThreshold()) {
+            BeamTrim(*searchFst, trimFst, beamWidth, 
+                     (searchStats ? &searchStats->getTrim() : 0), threshold, config_.isRecombine());
+        } else
             Prune(*searchFst, trimFst, config_.getTrimWidth());
         delete searchFst;
         searchFst = trimFst;
     }
+    times.lap(TRIM_STAGE, timer);
     
-    currTime_[timeStep_++] = clock();
     // remove duplicate paths if called for
     bool removeDup = !config_.isPrintDuplicates() && !(config_.isPrintAll() || config_.isPrintInput());
     if(config_.getN() > 1 && removeDup) {
@@ -263,8 +602,8 @@ fst::Fst<A> * Decoder::findBestPaths(const fst::Fst<A> * input,
         delete searchFst;
         searchFst = vecFst;
     }
+    times.lap(DEDUP_STAGE, timer);
     
-    currTime_[timeStep_++] = clock();
     // find the shortest path, or sample as necessary
     VectorFst<A> * bestFst = new VectorFst<A>;
     if(config_.isSample()) {
@@ -273,6 +612,9 @@ fst::Fst<A> * Decoder::findBestPaths(const fst::Fst<A> * input,
         ShortestPath(*searchFst, bestFst, config_.getN(), removeDup);
     }
     delete searchFst;
+    times.lap(SEARCH_STAGE, timer);
+    if(searchStats)
+        searchStats->countResult(*bestFst);
     
     return bestFst;
 
@@ -280,7 +622,7 @@ fst::Fst<A> * Decoder::findBestPaths(const fst::Fst<A> * input,
 
 // load an FST from the input stream
 template <class A>
-VectorFst<A> * Decoder::makeFst(istream &in) {
+VectorFst<A> * Decoder::makeFst(Strings & unknowns, istream &in) const {
     typedef typename A::Weight Weight;
     string line;
     // flat input
@@ -288,7 +630,7 @@ VectorFst<A> * Decoder::makeFst(istream &in) {
         if(!getline(in, line))
             return NULL;
         Strings tokens = splitTokens(line);
-        return makeFst<A>(tokens);
+        return makeFst<A>(unknowns, tokens);
     } 
     // fst input
     else {
@@ -344,7 +686,7 @@ VectorFst<A> * Decoder::makeFst(istream &in) {
 
 // make the input fst with a template for arcs
 template <class A> 
-VectorFst<A> * Decoder::makeFst(const Strings & arr) {
+VectorFst<A> * Decoder::makeFst(Strings & unknowns, const Strings & arr) const {
  
 	// create the input FST
 	VectorFst<A> * inputFst = new VectorFst<A>();
@@ -357,7 +699,7 @@ VectorFst<A> * Decoder::makeFst(const Strings & arr) {
     int brId = config_.getInputTerminalId();
 
     // clear the vector of unknown words
-    unknowns_.clear();
+    unknowns.clear();
 
 	// get the IDs for all the tokens
 	for(Strings::const_iterator it = arr.begin(); it != arr.end(); it++) {
@@ -366,7 +708,7 @@ VectorFst<A> * Decoder::makeFst(const Strings & arr) {
 		if(id == -1) {
             if(unkId == -1) 
                 throw runtime_error("Unknown symbol exists in input, but no unknown ID set");
-            unknowns_.push_back(*it);
+            unknowns.push_back(*it);
 			id = unkId;
         }
 		// create the next state and a link to it
@@ -0,0 +1,131 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// parallel-decoder.cc
+//
+//  Sentence-parallel decoding with ordered output
+
+#include <sstream>
+#include <vector>
+#include <stdexcept>
+#include <kyfd/parallel-decoder.h>
+
+using namespace std;
+using namespace kyfd;
+
+ParallelDecoder::ParallelDecoder(Decoder & decoder, unsigned numThreads, unsigned queueSize) :
+    decoder_(decoder), numThreads_(numThreads), queueSize_(queueSize), in_(0), nextRead_(0),
+    failed_(false), error_(), numWritten_(0), out_(0), nextWrite_(0), pending_() {
+    if(numThreads_ < 1)
+        throw runtime_error("A parallel decoder needs at least one thread");
+    if(queueSize_ < 1)
+        throw runtime_error("A parallel decoder needs a queue size of at least one");
+}
+
+int ParallelDecoder::decode(istream & in, ostream & out) {
+    in_ = &in;
+    out_ = &out;
+    failed_ = false;
+    numWritten_ = nextWrite_;
+
+    // start the threads and wait for them to finish
+    vector<pthread_t> threads;
+    try {
+        for(unsigned i = 0; i < numThreads_; i++)
+            threads.push_back(StartThread(runWorker, this));
+    } catch(std::exception & e) {
+        // stop the threads that did start before leaving, as they use the
+        //  streams and the members of this decoder
+        setError(e.what());
+        for(unsigned i = 0; i < threads.size(); i++)
+            pthread_join(threads[i], NULL);
+        throw;
+    }
+    for(unsigned i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+
+    if(failed_)
+        throw runtime_error(error_);
+    return nextWrite_;
+}
+
+void* ParallelDecoder::runWorker(void* ptr) {
+    ((ParallelDecoder*)ptr)->work();
+    return NULL;
+}
+
+void ParallelDecoder::work() {
+    try {
+        // each thread has its own context, which is reset instead of
+        //  rebuilding the shared models when reloading
+        DecodeContext ctx(decoder_);
+        unsigned reload = decoder_.getConfig().getReload();
+        unsigned count = 0;
+        string sentence;
+        int id;
+        while(readSentence(sentence, id)) {
+            istringstream iss(sentence);
+            ostringstream oss;
+            ctx.setSentenceId(id);
+            decoder_.decode(ctx, iss, oss);
+            writeResult(id, oss.str());
+            if(reload && ++count % reload == 0)
+                ctx.reset();
+        }
+    } catch(std::exception & e) {
+        setError(e.what());
+    }
+}
+
+bool ParallelDecoder::readSentence(string & sentence, int & id) {
+    ThreadLock lock(inMutex_);
+    // the sentence after the last one written is always being decoded, so
+    //  the window always opens again
+    while(!failed_ && nextRead_ - numWritten_ >= (int)queueSize_)
+        window_.wait(inMutex_);
+    if(failed_ || !decoder_.readSentence(*in_, sentence))
+        return false;
+    id = nextRead_++;
+    return true;
+}
+
+void ParallelDecoder::writeResult(int id, const string & result) {
+    ThreadLock lock(outMutex_);
+    pending_[id] = result;
+    // write out every result that is now in order
+    map<int, string>::iterator it;
+    while((it = pending_.find(nextWrite_)) != pending_.end()) {
+        *out_ << it->second;
+        pending_.erase(it);
+        if(++nextWrite_ % 100 == 0)
+            cerr << nextWrite_;
+        else
+            cerr << ".";
+    }
+    out_->flush();
+    // let readers waiting for the window continue, taking the input lock
+    //  only while holding the output lock and never the other way around
+    ThreadLock inLock(inMutex_);
+    numWritten_ = nextWrite_;
+    window_.broadcast();
+}
+
+void ParallelDecoder::setError(const string & error) {
+    ThreadLock lock(inMutex_);
+    if(!failed_)
+        error_ = error;
+    failed_ = true;
+    window_.broadcast();
+}
@@ -0,0 +1,198 @@
+//   Copyright 2009, Kyfd Project Team
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+//
+// pipeline-decoder.cc
+//
+//  Pipelined decoding with separate reading, searching and writing threads
+
+#include <map>
+#include <vector>
+#include <stdexcept>
+#include <kyfd/pipeline-decoder.h>
+
+using namespace std;
+using namespace kyfd;
+
+PipelineDecoder::PipelineDecoder(Decoder & decoder, unsigned numThreads, unsigned queueSize) :
+    decoder_(decoder), numThreads_(numThreads), queueSize_(queueSize), in_(0), out_(0),
+    inputs_(queueSize), results_(queueSize), numRead_(0), numWritten_(0),
+    activeWorkers_(0), failed_(false), error_() {
+    if(numThreads_ < 1)
+        throw runtime_error("A pipeline decoder needs at least one search thread");
+    if(queueSize_ < 1)
+        throw runtime_error("The pipeline queue size must be at least 1");
+}
+
+PipelineDecoder::~PipelineDecoder() {
+    // delete anything left over after an error
+    inputs_.close();
+    results_.close();
+    DecodeInput * input;
+    while(inputs_.pop(input))
+        delete input;
+    DecodeResult * result;
+    while(results_.pop(result))
+        delete result;
+}
+
+int PipelineDecoder::decode(istream & in, ostream & out) {
+    in_ = &in;
+    out_ = &out;
+    activeWorkers_ = numThreads_;
+
+    // start the threads and wait for them to finish
+    vector<pthread_t> threads;
+    unsigned startedWorkers = 0;
+    try {
+        threads.push_back(StartThread(runReader, this));
+        for( ; startedWorkers < numThreads_; startedWorkers++)
+            threads.push_back(StartThread(runWorker, this));
+        threads.push_back(StartThread(runWriter, this));
+    } catch(std::exception & e) {
+        // stop the threads that did start before leaving, closing the queues
+        //  so none of them waits for a thread that never ran
+        setError(e.what());
+        {
+            ThreadLock lock(mutex_);
+            activeWorkers_ -= numThreads_ - startedWorkers;
+        }
+        for(unsigned i = 0; i < threads.size(); i++)
+            pthread_join(threads[i], NULL);
+        throw;
+    }
+    for(unsigned i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+
+    if(failed_)
+        throw runtime_error(error_);
+    return numWritten_;
+}
+
+void* PipelineDecoder::runReader(void* ptr) {
+    ((PipelineDecoder*)ptr)->read();
+    return NULL;
+}
+
+void* PipelineDecoder::runWorker(void* ptr) {
+    ((PipelineDecoder*)ptr)->work();
+    return NULL;
+}
+
+void* PipelineDecoder::runWriter(void* ptr) {
+    ((PipelineDecoder*)ptr)->write();
+    return NULL;
+}
+
+void PipelineDecoder::read() {
+    try {
+        while(true) {
+            // wait until the writer has caught up
+            {
+                ThreadLock lock(mutex_);
+                while(!failed_ && numRead_ - numWritten_ >= (int)queueSize_)
+                    window_.wait(mutex_);
+                if(failed_)
+                    break;
+            }
+            DecodeInput * input = decoder_.readInput(*in_);
+            if(input == NULL)
+                break;
+            {
+                ThreadLock lock(mutex_);
+                input->setId(numRead_++);
+            }
+            if(!inputs_.push(input)) {
+                delete input;
+                break;
+            }
+        }
+    } catch(std::exception & e) {
+        setError(e.what());
+    }
+    inputs_.close();
+}
+
+void PipelineDecoder::work() {
+    try {
+        // each thread has its own context, which is reset instead of
+        //  rebuilding the shared models when reloading
+        DecodeContext ctx(decoder_);
+        unsigned reload = decoder_.getConfig().getReload();
+        unsigned count = 0;
+        DecodeInput * input;
+        while(inputs_.pop(input)) {
+            if(isFailed()) {
+                delete input;
+                continue;
+            }
+            DecodeResult * result = decoder_.search(ctx, input);
+            if(!results_.push(result))
+                delete result;
+            if(reload && ++count % reload == 0)
+                ctx.reset();
+        }
+    } catch(std::exception & e) {
+        setError(e.what());
+    }
+    // the last worker to finish tells the writer there is nothing more
+    ThreadLock lock(mutex_);
+    if(--activeWorkers_ == 0)
+        results_.close();
+}
+
+void PipelineDecoder::write() {
+    map<int, DecodeResult*> pending;
+    map<int, DecodeResult*>::iterator it;
+    int next = 0;
+    try {
+        DecodeResult * result;
+        while(results_.pop(result)) {
+            pending[result->getId()] = result;
+            // print every result that is now in order
+            while((it = pending.find(next)) != pending.end()) {
+                decoder_.printResult(*it->second, *out_);
+                delete it->second;
+                pending.erase(it);
+                if(++next % 100 == 0)
+                    cerr << next;
+                else
+                    cerr << ".";
+                ThreadLock lock(mutex_);
+                numWritten_ = next;
+                window_.signal();
+            }
+        }
+    } catch(std::exception & e) {
+        setError(e.what());
+    }
+    for(it = pending.begin(); it != pending.end(); it++)
+        delete it->second;
+    out_->flush();
+}
+
+void PipelineDecoder::setError(const string & error) {
+    ThreadLock lock(mutex_);
+    if(!failed_)
+        error_ = error;
+    failed_ = true;
+    window_.broadcast();
+    inputs_.close();
+    results_.close();
+}
+
+bool PipelineDecoder::isFailed() {
+    ThreadLock lock(mutex_);
+    return failed_;
+}